@@ -2,8 +2,24 @@
 
 #include <sstream>
 #include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <ctime>
+#include <functional>
+#include <limits>
+#include <iterator>
+#include <deque>
+#include <set>
 
 #include <Riostream.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 // ROOT includes
 #include "TSystem.h"
@@ -15,10 +31,19 @@
 #include "TRegexp.h"
 #include "TDatime.h"
 #include "TChain.h"
+#include "TNotifyLink.h"
 #include "TFileCollection.h"
 #include "TObjString.h"
 #include "TInterpreter.h"
 #include "TProof.h"
+#include "TMD5.h"
+#include "TStopwatch.h"
+#include "TFileMerger.h"
+#include "TBranch.h"
+#include "TTreeCache.h"
+#include "TMath.h"
+#include "TGrid.h"
+#include "TROOT.h"
 //
 // // STEER includes
 #include "AliESDInputHandler.h"
@@ -32,8 +57,523 @@
 #include "AliAnalysisManager.h"
 #include "AliAnalysisTaskSE.h"
 #include "AliAnalysisAlien.h"
+#include "AliAnalysisDataContainer.h"
 #include "AliAnalysisTaskCfg.h"
 
+//_______________________________________________________
+/// Download the remote input files of a local run in a disk cache,
+/// a few files ahead of the one being analysed.
+/// The files of each source directory are cached in their own directory,
+/// together with the sibling files read by the handlers from the directory
+/// of the current input (e.g. galice.root and Kinematics.root for the MC handler).
+/// It is linked to the notify object of the chain: when the chain opens a file,
+/// the prefetcher waits for the next one and moves the download window.
+/// The chain reads a file from the cache only once it is there with its required siblings,
+/// otherwise (failed download, missing notifications) it reads the remote file.
+/// The cache can be shared by several processes: each process keeps a shared lock
+/// on the cached files of its window, and the least recently used files
+/// which are not locked are removed when the cache exceeds its size
+class AliInputPrefetcher : public TObject
+{
+public:
+  /// Sibling file (name, required)
+  typedef std::pair<std::string,bool> Sibling;
+
+  AliInputPrefetcher ( TChain* chain, const std::vector<std::string>& urls, const std::vector<Sibling>& siblings, const char* cacheDir, int nAhead, Long64_t maxCacheSize, int latencyMs );
+  virtual ~AliInputPrefetcher ();
+
+  bool Notify ();
+  void Print ( Option_t* opt = "" ) const;
+  void WaitFor ( size_t ifile );
+
+private:
+  enum { kPending, kFetched, kHit, kLocal, kFailed };
+
+  int Fetch ( size_t ifile );
+  void Evict ();
+  bool Pin ( const std::string& cachedName, std::vector<int>& fds ) const;
+  void Run ();
+  void Unpin ( size_t beforeFile );
+
+  TChain* fChain; ///< Chain
+  TNotifyLink<AliInputPrefetcher> fNotifyLink; ///< Link to the notify object of the chain
+  std::vector<std::string> fUrls; ///< Input files
+  std::vector<std::string> fCachedNames; ///< Names in the cache
+  std::vector<Sibling> fSiblings; ///< Files read from the directory of each input
+  std::vector<int> fStatus; ///< Download status
+  std::string fCacheDir; ///< Cache directory
+  size_t fNahead; ///< Number of files downloaded in advance
+  Long64_t fMaxCacheSize; ///< Maximum size of the cache
+  int fLatencyMs; ///< Artificial latency of each download (for tests)
+  size_t fCurrent; ///< File being analysed
+  int fNnotified; ///< Number of notifications of the chain
+  std::map<size_t,std::vector<int>> fPins; ///< Locked descriptors of the cached files in use (input and siblings)
+  bool fStop; ///< Stop the downloads
+  double fStallTime; ///< Time spent waiting for the downloads
+  Long64_t fFetchedBytes; ///< Downloaded bytes
+  std::mutex fMutex; ///< Protects the status and the window
+  std::condition_variable fCondition; ///< Signals status and window changes
+  std::thread fThread; ///< Download thread
+};
+
+//_______________________________________________________
+AliInputPrefetcher::AliInputPrefetcher ( TChain* chain, const std::vector<std::string>& urls, const std::vector<Sibling>& siblings, const char* cacheDir, int nAhead, Long64_t maxCacheSize, int latencyMs ) :
+TObject(),
+fChain(chain),
+fNotifyLink(this),
+fUrls(urls),
+fCachedNames(),
+fSiblings(siblings),
+fStatus(urls.size(),kPending),
+fCacheDir(gSystem->ExpandPathName(cacheDir)),
+fNahead(std::max(1,nAhead)),
+fMaxCacheSize(maxCacheSize),
+fLatencyMs(latencyMs),
+fCurrent(0),
+fNnotified(0),
+fPins(),
+fStop(false),
+fStallTime(0.),
+fFetchedBytes(0),
+fMutex(),
+fCondition(),
+fThread()
+{
+  /// Ctr. The chain is filled with the input files,
+  /// which are replaced by the names in the cache when they are downloaded
+  gSystem->mkdir(fCacheDir.c_str(),true);
+  for ( auto& url : fUrls ) {
+    std::string cachedName = url;
+    if ( url.find("://") != std::string::npos ) {
+      // Same remote directory, same directory in the cache
+      std::string dirName = url.substr(0,url.find_last_of('/'));
+      TMD5 md5;
+      md5.Update(reinterpret_cast<const UChar_t*>(dirName.c_str()),dirName.size());
+      md5.Final();
+      cachedName = Form("%s/%s/%s",fCacheDir.c_str(),md5.AsString(),gSystem->BaseName(url.c_str()));
+    }
+    fCachedNames.push_back(cachedName);
+    fChain->Add(url.c_str());
+  }
+  // The link keeps the notify objects set on the chain by the analysis
+  fNotifyLink.PrependLink(*fChain);
+  ROOT::EnableThreadSafety();
+  fThread = std::thread(&AliInputPrefetcher::Run,this);
+}
+
+//_______________________________________________________
+AliInputPrefetcher::~AliInputPrefetcher ()
+{
+  /// Dtor
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    fStop = true;
+  }
+  fCondition.notify_all();
+  if ( fThread.joinable() ) fThread.join();
+  Unpin(fUrls.size());
+  if ( fChain->GetNotify() == &fNotifyLink ) fNotifyLink.RemoveLink(*fChain);
+}
+
+//_______________________________________________________
+void AliInputPrefetcher::Evict ()
+{
+  /// Remove the least recently used files until the cache fits its size.
+  /// The files in use are locked (by this process or by the others)
+  /// and they are kept, as well as the ongoing downloads
+  std::vector<std::pair<Long_t,std::pair<std::string,Long64_t>>> files;
+  Long64_t cacheSize = 0;
+  void* dir = gSystem->OpenDirectory(fCacheDir.c_str());
+  const char* entry = nullptr;
+  while ( dir && (entry = gSystem->GetDirEntry(dir)) ) {
+    if ( entry[0] == '.' ) continue;
+    std::string subdirName = Form("%s/%s",fCacheDir.c_str(),entry);
+    void* subdir = gSystem->OpenDirectory(subdirName.c_str());
+    const char* subentry = nullptr;
+    while ( subdir && (subentry = gSystem->GetDirEntry(subdir)) ) {
+      FileStat_t fileStat;
+      std::string filename = Form("%s/%s",subdirName.c_str(),subentry);
+      if ( gSystem->GetPathInfo(filename.c_str(),fileStat) != 0 || R_ISDIR(fileStat.fMode) ) continue;
+      cacheSize += fileStat.fSize;
+      if ( TString(subentry).EndsWith(".part") ) continue;
+      files.push_back(std::make_pair(fileStat.fMtime,std::make_pair(filename,fileStat.fSize)));
+    }
+    if ( subdir ) gSystem->FreeDirectory(subdir);
+  }
+  if ( dir ) gSystem->FreeDirectory(dir);
+  std::sort(files.begin(),files.end());
+  for ( auto& file : files ) {
+    if ( cacheSize <= fMaxCacheSize ) break;
+    int fd = open(file.second.first.c_str(),O_RDONLY);
+    if ( fd < 0 ) continue;
+    if ( flock(fd,LOCK_EX|LOCK_NB) == 0 && gSystem->Unlink(file.second.first.c_str()) == 0 ) cacheSize -= file.second.second;
+    close(fd);
+  }
+}
+
+//_______________________________________________________
+int AliInputPrefetcher::Fetch ( size_t ifile )
+{
+  /// Download the file and its siblings in the cache (if they are not already there).
+  /// The download fails if the file or one of its required siblings cannot be downloaded
+  const std::string& url = fUrls[ifile];
+  const std::string& cachedName = fCachedNames[ifile];
+  if ( cachedName == url ) return kLocal;
+  std::string remoteDir = url.substr(0,url.find_last_of('/'));
+  std::string cachedDir = gSystem->DirName(cachedName.c_str());
+  gSystem->mkdir(cachedDir.c_str(),true);
+  std::vector<std::pair<std::string,bool>> names(1,std::make_pair(std::string(gSystem->BaseName(cachedName.c_str())),true));
+  names.insert(names.end(),fSiblings.begin(),fSiblings.end());
+
+  std::vector<int> fds;
+  bool isHit = true;
+  for ( auto& name : names ) {
+    std::string cachedFile = cachedDir + "/" + name.first;
+    if ( Pin(cachedFile,fds) ) {
+      // Used now: it becomes the most recent file for the eviction
+      gSystem->Utime(cachedFile.c_str(),time(nullptr),0);
+      continue;
+    }
+    isHit = false;
+    if ( fLatencyMs > 0 ) std::this_thread::sleep_for(std::chrono::milliseconds(fLatencyMs));
+    // Each process has its own partial download
+    std::string tmpName = Form("%s.%i.part",cachedFile.c_str(),gSystem->GetPid());
+    bool isOk = ( TFile::Cp(Form("%s/%s",remoteDir.c_str(),name.first.c_str()),tmpName.c_str(),false) && gSystem->Rename(tmpName.c_str(),cachedFile.c_str()) == 0 );
+    if ( ! isOk ) gSystem->Unlink(tmpName.c_str());
+    // Another process can remove the file before it is locked
+    else isOk = Pin(cachedFile,fds);
+    if ( isOk ) {
+      FileStat_t fileStat;
+      if ( gSystem->GetPathInfo(cachedFile.c_str(),fileStat) == 0 ) fFetchedBytes += fileStat.fSize;
+    }
+    else if ( name.second ) {
+      for ( int fd : fds ) close(fd);
+      return kFailed;
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    for ( int fd : fPins[ifile] ) close(fd);
+    fPins[ifile] = fds;
+  }
+  if ( isHit ) return kHit;
+  Evict();
+  return kFetched;
+}
+
+//_______________________________________________________
+bool AliInputPrefetcher::Notify ()
+{
+  /// The chain opened a new file: move the window and wait for the next file
+  int itree = fChain->GetTreeNumber();
+  if ( itree < 0 ) return true;
+  fNnotified++;
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    fCurrent = itree;
+  }
+  fCondition.notify_all();
+  Unpin(itree);
+  WaitFor(itree+1);
+  return true;
+}
+
+//_______________________________________________________
+bool AliInputPrefetcher::Pin ( const std::string& cachedName, std::vector<int>& fds ) const
+{
+  /// Lock the cached file, so that the other processes do not remove it,
+  /// and add its descriptor to fds.
+  /// Return false if the file is not in the cache
+  int fd = open(cachedName.c_str(),O_RDONLY);
+  if ( fd < 0 ) return false;
+  struct stat fileStat;
+  if ( flock(fd,LOCK_SH) != 0 || fstat(fd,&fileStat) != 0 || fileStat.st_nlink == 0 ) {
+    // Removed by another process in the meantime
+    close(fd);
+    return false;
+  }
+  fds.push_back(fd);
+  return true;
+}
+
+//_______________________________________________________
+void AliInputPrefetcher::Print ( Option_t* ) const
+{
+  /// Print the summary
+  int nStatus[kFailed+1] = {0};
+  for ( int status : fStatus ) nStatus[status]++;
+  int nRemote = nStatus[kFetched] + nStatus[kHit] + nStatus[kFailed];
+  std::cout << "Prefetch: " << nRemote << " remote files, " << nStatus[kHit] << " in cache (hit rate " << ( nRemote > 0 ? 100. * nStatus[kHit] / nRemote : 0. ) << "%), " << nStatus[kFetched] << " downloaded (" << fFetchedBytes << " bytes), " << nStatus[kFailed] << " failed. Stalled " << fStallTime << " s waiting for the downloads" << std::endl;
+  if ( fUrls.size() > 1 && fNnotified == 0 ) std::cout << "Warning: the prefetcher was not notified by the chain: the files after the first one were read remotely" << std::endl;
+}
+
+//_______________________________________________________
+void AliInputPrefetcher::Run ()
+{
+  /// Download the files in order, at most fNahead files after the current one
+  for ( size_t ifile=0; ifile<fUrls.size(); ++ifile ) {
+    {
+      std::unique_lock<std::mutex> lock(fMutex);
+      fCondition.wait(lock,[&]() { return fStop || ifile <= fCurrent + fNahead; });
+      if ( fStop ) return;
+    }
+    int status = Fetch(ifile);
+    {
+      std::lock_guard<std::mutex> lock(fMutex);
+      fStatus[ifile] = status;
+    }
+    fCondition.notify_all();
+  }
+}
+
+//_______________________________________________________
+void AliInputPrefetcher::Unpin ( size_t beforeFile )
+{
+  /// Unlock the cached files before beforeFile, which are not used anymore
+  std::lock_guard<std::mutex> lock(fMutex);
+  for ( auto pin = fPins.begin(); pin != fPins.end() && pin->first < beforeFile; ) {
+    for ( int fd : pin->second ) close(fd);
+    pin = fPins.erase(pin);
+  }
+}
+
+//_______________________________________________________
+void AliInputPrefetcher::WaitFor ( size_t ifile )
+{
+  /// Wait until the file is downloaded, then point the chain to the cached file.
+  /// If the download failed or the cached file is missing, the chain reads the remote file
+  if ( ifile >= fUrls.size() ) return;
+  auto start = std::chrono::steady_clock::now();
+  int status = kPending;
+  {
+    std::unique_lock<std::mutex> lock(fMutex);
+    fCondition.wait(lock,[&]() { return fStatus[ifile] != kPending; });
+    status = fStatus[ifile];
+  }
+  fStallTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if ( status == kLocal ) return;
+  if ( status == kFailed || gSystem->AccessPathName(fCachedNames[ifile].c_str()) ) {
+    std::cout << "Warning: cannot prefetch " << fUrls[ifile] << ": reading it remotely" << std::endl;
+    return;
+  }
+  static_cast<TNamed*>(fChain->GetListOfFiles()->At(ifile))->SetTitle(fCachedNames[ifile].c_str());
+}
+
+//_______________________________________________________
+/// Merge partial outputs while they become available.
+/// Each source is fetched by a pool of threads, and polled until it is ready.
+/// The fetched files are reduced in a binary tree (as a binary counter):
+/// two partial results of the same level are merged in one of the next level,
+/// so that at most log2(n) partial results are left for the final merge
+class AliStreamingMerger : public TObject
+{
+public:
+  /// Fetch the source: return true and fill the list of local files when it is ready
+  typedef std::function<bool(std::vector<std::string>&)> Fetcher;
+
+  AliStreamingMerger ( const char* outDir, const char* mergeDir, int nConcurrent, int pollSeconds );
+  virtual ~AliStreamingMerger () {}
+
+  void AddSource ( const char* name, Fetcher fetcher );
+  /// Sources that could not be fetched
+  const std::vector<std::string>& GetFailed () const { return fFailed; }
+  void Print ( Option_t* opt = "" ) const;
+  bool Run ( std::function<bool()> isProducerDone );
+
+private:
+  void Fetch ( std::function<bool()> isProducerDone );
+  bool MergeFiles ( const std::vector<std::string>& inFiles, const char* outFile );
+  void Reduce ( const std::string& filename, bool isOwned );
+  void UpdatePeakMemory ();
+
+  std::string fOutDir; ///< Output directory
+  std::string fMergeDir; ///< Directory of the partial results
+  int fNconcurrent; ///< Number of concurrent fetches
+  int fPollSeconds; ///< Interval between two attempts to fetch a source
+  std::vector<std::pair<std::string,Fetcher>> fSources; ///< Sources
+  std::deque<size_t> fPending; ///< Sources to be fetched
+  std::deque<std::vector<std::string>> fFetched; ///< Fetched files to be merged
+  std::vector<std::string> fFailed; ///< Sources that could not be fetched
+  std::map<std::string,std::vector<std::pair<std::string,bool>>> fLevels; ///< Partial results per output name and level (name, owned)
+  std::mutex fMutex; ///< Protects the queues
+  std::condition_variable fCondition; ///< Signals the fetched sources
+  int fNmerges; ///< Number of merge steps
+  double fMergeTime; ///< Time spent merging
+  double fFinalMergeTime; ///< Time between the last fetched source and the end of the merge
+  double fTotalTime; ///< Total time
+  long fPeakMemory; ///< Peak resident memory (kB)
+};
+
+//_______________________________________________________
+AliStreamingMerger::AliStreamingMerger ( const char* outDir, const char* mergeDir, int nConcurrent, int pollSeconds ) :
+TObject(),
+fOutDir(outDir),
+fMergeDir(mergeDir),
+fNconcurrent(std::max(1,nConcurrent)),
+fPollSeconds(pollSeconds),
+fSources(),
+fPending(),
+fFetched(),
+fFailed(),
+fLevels(),
+fMutex(),
+fCondition(),
+fNmerges(0),
+fMergeTime(0.),
+fFinalMergeTime(0.),
+fTotalTime(0.),
+fPeakMemory(0)
+{
+  /// Ctr
+}
+
+//_______________________________________________________
+void AliStreamingMerger::AddSource ( const char* name, Fetcher fetcher )
+{
+  /// Add a source
+  fPending.push_back(fSources.size());
+  fSources.push_back(std::make_pair(std::string(name),fetcher));
+}
+
+//_______________________________________________________
+void AliStreamingMerger::Fetch ( std::function<bool()> isProducerDone )
+{
+  /// Fetch the pending sources.
+  /// A source which is not ready is tried again later,
+  /// and it is failed if it is still not ready once the producer is done
+  while ( true ) {
+    size_t isource = 0;
+    {
+      std::lock_guard<std::mutex> lock(fMutex);
+      if ( fPending.empty() ) return;
+      isource = fPending.front();
+      fPending.pop_front();
+    }
+    bool isLastAttempt = isProducerDone();
+    std::vector<std::string> files;
+    bool isFetched = fSources[isource].second(files);
+    if ( ! isFetched && ! isLastAttempt ) {
+      std::this_thread::sleep_for(std::chrono::seconds(fPollSeconds));
+      std::lock_guard<std::mutex> lock(fMutex);
+      fPending.push_back(isource);
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(fMutex);
+      if ( isFetched ) fFetched.push_back(files);
+      else {
+        fFetched.push_back(std::vector<std::string>());
+        fFailed.push_back(fSources[isource].first);
+      }
+    }
+    fCondition.notify_all();
+  }
+}
+
+//_______________________________________________________
+bool AliStreamingMerger::MergeFiles ( const std::vector<std::string>& inFiles, const char* outFile )
+{
+  /// Merge the files
+  TStopwatch sw;
+  TFileMerger merger(false);
+  merger.SetPrintLevel(0);
+  merger.OutputFile(outFile);
+  for ( auto& inFile : inFiles ) merger.AddFile(inFile.c_str(),false);
+  bool isOk = merger.Merge();
+  if ( ! isOk ) std::cout << "Error: cannot merge " << outFile << std::endl;
+  ++fNmerges;
+  fMergeTime += sw.RealTime();
+  UpdatePeakMemory();
+  return isOk;
+}
+
+//_______________________________________________________
+void AliStreamingMerger::Print ( Option_t* ) const
+{
+  /// Print the summary
+  std::cout << "Streaming merge of " << fSources.size() << " sources (" << fFailed.size() << " missing): " << fNmerges << " merge steps in " << fMergeTime << " s, final merge " << fFinalMergeTime << " s after the last source, total " << fTotalTime << " s. Peak resident memory " << fPeakMemory / 1024. << " MB" << std::endl;
+  for ( auto& name : fFailed ) std::cout << "  missing: " << name << std::endl;
+}
+
+//_______________________________________________________
+void AliStreamingMerger::Reduce ( const std::string& filename, bool isOwned )
+{
+  /// Add the file to the reduction tree of its output name
+  std::string basename = gSystem->BaseName(filename.c_str());
+  std::vector<std::pair<std::string,bool>>& levels = fLevels[basename];
+  std::pair<std::string,bool> carry(filename,isOwned);
+  for ( size_t ilevel=0; ; ++ilevel ) {
+    if ( ilevel == levels.size() ) levels.push_back(std::make_pair(std::string(),false));
+    if ( levels[ilevel].first.empty() ) {
+      levels[ilevel] = carry;
+      return;
+    }
+    std::string merged = Form("%s/level%i_%i_%s",fMergeDir.c_str(),(int)ilevel+1,fNmerges,basename.c_str());
+    std::vector<std::string> inFiles = {levels[ilevel].first,carry.first};
+    bool isOk = MergeFiles(inFiles,merged.c_str());
+    if ( levels[ilevel].second ) gSystem->Unlink(levels[ilevel].first.c_str());
+    if ( carry.second ) gSystem->Unlink(carry.first.c_str());
+    levels[ilevel] = std::make_pair(std::string(),false);
+    // If the merge fails, the partial result is lost: it is reported in the output
+    if ( ! isOk ) return;
+    carry = std::make_pair(merged,true);
+  }
+}
+
+//_______________________________________________________
+bool AliStreamingMerger::Run ( std::function<bool()> isProducerDone )
+{
+  /// Fetch the sources and merge them while they arrive.
+  /// Return false if a source is missing or a merge failed
+  TStopwatch sw;
+  ROOT::EnableThreadSafety();
+  gSystem->mkdir(fMergeDir.c_str(),true);
+  std::vector<std::thread> fetchers;
+  for ( int ithread=0; ithread<fNconcurrent; ++ithread ) fetchers.push_back(std::thread(&AliStreamingMerger::Fetch,this,isProducerDone));
+
+  for ( size_t isource=0; isource<fSources.size(); ++isource ) {
+    std::vector<std::string> files;
+    {
+      std::unique_lock<std::mutex> lock(fMutex);
+      fCondition.wait(lock,[&]() { return ! fFetched.empty(); });
+      files = fFetched.front();
+      fFetched.pop_front();
+    }
+    for ( auto& file : files ) Reduce(file,false);
+    UpdatePeakMemory();
+  }
+  for ( auto& thread : fetchers ) thread.join();
+
+  // Final merge of the partial results left (at most log2(n) per output)
+  TStopwatch finalSw;
+  bool isOk = fFailed.empty();
+  for ( auto& entry : fLevels ) {
+    std::vector<std::string> inFiles;
+    for ( auto& level : entry.second ) {
+      if ( ! level.first.empty() ) inFiles.push_back(level.first);
+    }
+    if ( inFiles.empty() ) continue;
+    std::string outFile = Form("%s/%s",fOutDir.c_str(),entry.first.c_str());
+    if ( ! MergeFiles(inFiles,outFile.c_str()) ) isOk = false;
+    for ( auto& level : entry.second ) {
+      if ( level.second ) gSystem->Unlink(level.first.c_str());
+    }
+  }
+  fLevels.clear();
+  fFinalMergeTime = finalSw.RealTime();
+  fTotalTime = sw.RealTime();
+  gSystem->Exec(Form("rmdir %s 2>/dev/null",fMergeDir.c_str()));
+  return isOk;
+}
+
+//_______________________________________________________
+void AliStreamingMerger::UpdatePeakMemory ()
+{
+  /// Update the peak resident memory
+  ProcInfo_t procInfo;
+  if ( gSystem->GetProcInfo(&procInfo) == 0 ) fPeakMemory = std::max(fPeakMemory,procInfo.fMemResident);
+}
+
 //_______________________________________________________
 AliTaskSubmitter::AliTaskSubmitter() :
 fHasCentralityInfo(false),
@@ -44,18 +584,27 @@ fIsMC(false),
 fIsPodMachine(false),
 fProofResume(false),
 fProofSplitPerRun(false),
+fReducedOADBPar(false),
 fFileType(kAOD),
 fProofNworkers(80),
+fLocalNworkers(0),
+fBranchLearnEntries(0),
+fPrefetchFiles(0),
+fPrefetchLatency(0),
+fStreamMergeJobs(4),
+fStreamMergePoll(30),
 fRunMode(kLocal),
 fGridTestFiles(1),
 fAlienUsername(),
 fAliPhysicsBuildDir(),
+fBranchSetFile(),
 fGridDataDir(),
 fGridDataPattern(),
 fGridWorkingDir(),
 fPass(),
 fPeriod(),
 fPodOutDir(),
+fPrefetchCacheDir("/tmp/inputPrefetchCache"),
 fProofCluster(),
 fProofDatasetMode(),
 fProofServer(),
@@ -63,6 +612,7 @@ fProofCopyCommand(),
 fProofOpenCommand(),
 fProofExecCommand(),
 fSoftVersion(),
+fStagingCacheDir("$HOME/.taskSubmitterCache"),
 fSubmitterDir(),
 fTaskOptions(),
 fWorkDir(),
@@ -70,13 +620,20 @@ fAdditionalFiles(),
 fInputData(),
 fLibraries(),
 fMacros(),
+fOADBExtraObjects(),
 fPackages(),
+fPrefetchSiblings(),
 fSources(),
 fTasks(),
 fKeywords(),
 fUtilityMacros(),
 fMap(),
-fPlugin(nullptr)
+fPlugin(nullptr),
+fNstagedFiles(),
+fStagedBytes(),
+fPrefetchCacheSize(20LL*1024*1024*1024),
+fTreeCacheSize(0),
+fTreeCacheLearnEntries(-1)
 // fInputObject(nullptr)
 {
   /// Ctr
@@ -110,6 +667,14 @@ void AliTaskSubmitter::AddObjects ( const char* objnameList, std::vector<std::st
   delete arr;
 }
 
+//_______________________________________________________
+void AliTaskSubmitter::AddStartupPhase ( std::vector<std::pair<std::string,double>>& phases, const char* name, TStopwatch& sw ) const
+{
+  /// Record the time spent in the startup phase and restart the stopwatch
+  phases.push_back(std::make_pair(name,sw.RealTime()));
+  sw.Start(true);
+}
+
 //_______________________________________________________
 bool AliTaskSubmitter::AddTask ( const char* configFilename )
 {
@@ -147,10 +712,140 @@ bool AliTaskSubmitter::AddTask ( const char* configFilename )
   return true;
 }
 
+//_______________________________________________________
+bool AliTaskSubmitter::BuildPars ( const std::vector<std::string>& pars )
+{
+  /// Build the par files in the AliPhysics build dir and stage them in the working dir.
+  /// The builds are cached, keyed on the state of the AliPhysics sources:
+  /// only the par files which are not in the cache are built (in parallel).
+  /// The OADB par contains the full OADB, unless SetReducedOADBPar is used
+  if ( ! SetAliPhysicsBuildDir() ) {
+    std::cout << "Cannot find par file and cannot build it" << std::endl;
+    return false;
+  }
+
+  std::string absWorkDir = GetAbsolutePath(fWorkDir.c_str());
+  std::string buildKey = GetParBuildKey();
+  std::string parCacheDir = ( fStagingCacheDir.empty() ) ? absWorkDir : Form("%s/par/%s",gSystem->ExpandPathName(fStagingCacheDir.c_str()),buildKey.c_str());
+  gSystem->mkdir(parCacheDir.c_str(),true);
+
+  std::vector<std::string> toBuild;
+  for ( auto& par : pars ) {
+    if ( gSystem->AccessPathName(Form("%s/%s",parCacheDir.c_str(),par.c_str())) ) toBuild.push_back(par);
+  }
+
+  if ( ! toBuild.empty() ) {
+    // A single make for all of the par files, so that they are built in parallel
+    // without racing on their common dependencies
+    std::string targets = "";
+    for ( auto& par : toBuild ) targets += " " + par;
+    std::cout << "Building" << targets << " (key " << buildKey << ")" << std::endl;
+    TStopwatch sw;
+    if ( gSystem->Exec(Form("cd %s && make -j%i%s",fAliPhysicsBuildDir.c_str(),std::max(1,(int)std::thread::hardware_concurrency()),targets.c_str())) != 0 ) return false;
+    for ( auto& par : toBuild ) {
+      TString builtPar = gSystem->GetFromPipe(Form("find %s -name %s | head -n 1",fAliPhysicsBuildDir.c_str(),par.c_str()));
+      if ( builtPar.IsNull() || gSystem->Exec(Form("mv %s %s/",builtPar.Data(),parCacheDir.c_str())) != 0 ) {
+        std::cout << "Error: cannot find " << par << " in " << fAliPhysicsBuildDir << std::endl;
+        return false;
+      }
+    }
+    std::cout << "Built " << toBuild.size() << " par files in " << sw.RealTime() << " s" << std::endl;
+  }
+
+  for ( auto& par : pars ) {
+    std::string cachedPar = Form("%s/%s",parCacheDir.c_str(),par.c_str());
+    if ( par.find("OADB") != std::string::npos ) {
+      // Fixes problem with OADB on proof:
+      // the par file only contians the srcs
+      // but if you want to access OADB object they must be inside there!
+      std::string oadbPar = cachedPar;
+      oadbPar.insert(oadbPar.find_last_of("."),Form(".%s",GetOADBObjectsKey().c_str()));
+      if ( fStagingCacheDir.empty() || gSystem->AccessPathName(oadbPar.c_str()) ) {
+        if ( ! BuildOADBPar(cachedPar.c_str(),oadbPar.c_str()) ) return false;
+      }
+      if ( fStagingCacheDir.empty() ) gSystem->Rename(oadbPar.c_str(),cachedPar.c_str());
+      else cachedPar = oadbPar;
+    }
+    if ( fStagingCacheDir.empty() ) continue;
+    if ( ! CopyFile(cachedPar.c_str(),par.c_str()) ) return false;
+  }
+
+  return true;
+}
+
+//_______________________________________________________
+bool AliTaskSubmitter::ApplyBranchSet () const
+{
+  /// Read only the branches learned for this train (see LearnBranches)
+  /// and size the TTreeCache for them.
+  /// The set is only used if all of the tasks declare their branches
+  if ( ! TasksDeclareBranches() ) return false;
+  std::ifstream inFile(fBranchSetFile.c_str());
+  std::string header;
+  Long64_t nEntries = 0, allBytes = 0, keptBytes = 0;
+  std::string branches;
+  if ( ! ( inFile >> header >> nEntries >> allBytes >> keptBytes ) || header != "#" ) return false;
+  inFile.ignore(std::numeric_limits<std::streamsize>::max(),'\n');
+  if ( ! std::getline(inFile,branches) || branches.empty() ) return false;
+
+  AliAnalysisManager* mgr = AliAnalysisManager::GetAnalysisManager();
+  AliInputEventHandler* handler = static_cast<AliInputEventHandler*>(mgr->GetInputEventHandler());
+  AliMultiInputEventHandler* multiHandler = dynamic_cast<AliMultiInputEventHandler*>(handler);
+  if ( multiHandler ) handler = multiHandler->GetFirstInputEventHandler();
+  if ( ! handler ) return false;
+  handler->SetInactiveBranches("*");
+  handler->SetActiveBranches(branches.c_str());
+
+  // The branches are known: no need of a long learning phase of the TTreeCache.
+  // The cache holds the baskets of ~1000 entries of the active branches.
+  // The setting is global: it is restored after the analysis (see Run)
+  if ( fTreeCacheLearnEntries < 0 ) fTreeCacheLearnEntries = TTreeCache::GetLearnEntries();
+  TTreeCache::SetLearnEntries(1);
+  if ( fTreeCacheSize <= 0 && nEntries > 0 ) {
+    Long64_t cacheSize = 1000 * keptBytes / nEntries;
+    cacheSize = TMath::Min(TMath::Max(cacheSize,10LL*1024*1024),200LL*1024*1024);
+    mgr->SetCacheSize(cacheSize);
+  }
+  int nBranches = TString(branches.c_str()).CountChar(' ') + 1;
+  std::cout << "Reading " << nBranches << " learned branches (" << ( allBytes > 0 ? 100. * keptBytes / allBytes : 100. ) << "% of the compressed size): " << branches << std::endl;
+  return true;
+}
+
+//_______________________________________________________
+bool AliTaskSubmitter::BuildOADBPar ( const char* sourcePar, const char* outPar ) const
+{
+  /// Build outPar from the OADB par file, adding the OADB objects
+  /// (all of them, or only the referenced ones with SetReducedOADBPar)
+  std::vector<std::string> objects = GetOADBObjects();
+  std::string tmpDir = Form("%s.%i",outPar,gSystem->GetPid());
+  gSystem->mkdir(tmpDir.c_str(),true);
+  std::string command = Form("cd %s && tar -xzf %s",tmpDir.c_str(),sourcePar);
+  if ( objects.empty() ) {
+    if ( fReducedOADBPar ) std::cout << "Warning: no reference to OADB objects found: the full OADB is added to the par file" << std::endl;
+    command += " && rsync -au --exclude=.svn --exclude=PROOF-INF.OADB $ALICE_PHYSICS/OADB/ OADB/";
+  }
+  else {
+    std::ofstream listFile(Form("%s/objects.txt",tmpDir.c_str()));
+    for ( auto& obj : objects ) listFile << obj << std::endl;
+    listFile.close();
+    std::cout << "Adding " << objects.size() << " OADB objects to the par file" << std::endl;
+    std::cout << "Warning: the OADB objects opened by compiled code must be added with SetReducedOADBPar" << std::endl;
+    command += " && rsync -aur --exclude=.svn --files-from=objects.txt $ALICE_PHYSICS/OADB/ OADB/";
+  }
+  command += Form(" && tar -czf %s OADB",outPar);
+  bool isOk = ( gSystem->Exec(command.c_str()) == 0 );
+  gSystem->Exec(Form("rm -rf %s",tmpDir.c_str()));
+  if ( ! isOk ) std::cout << "Error: cannot add the OADB objects to " << sourcePar << std::endl;
+  return isOk;
+}
+
 //_______________________________________________________
 bool AliTaskSubmitter::CopyFile ( const char* inFilename, const char* outFilename ) const
 {
-  /// Copy file
+  /// Copy file to the working directory.
+  /// The copy is skipped if the file in the working directory has the same content.
+  /// Otherwise the par files and collections are hard-linked from the staging cache,
+  /// where they are stored by content hash, while the other files are copied
   std::string expfname = gSystem->ExpandPathName(inFilename);
   if ( gSystem->AccessPathName(expfname.c_str()) ) {
     std::cout << "Error: cannot find " << inFilename << std::endl;
@@ -161,11 +856,112 @@ bool AliTaskSubmitter::CopyFile ( const char* inFilename, const char* outFilenam
   sOutFilename += "/";
   sOutFilename += ( outFilename ) ? outFilename : gSystem->BaseName(expfname.c_str());
 
-  TFile::Cp(expfname.c_str(), sOutFilename.c_str(),false);
+  FileStat_t fileStat;
+  gSystem->GetPathInfo(expfname.c_str(),fileStat);
+
+  if ( fStagingCacheDir.empty() ) {
+    TFile::Cp(expfname.c_str(), sOutFilename.c_str(),false);
+    fNstagedFiles[0]++;
+    fStagedBytes[0] += fileStat.fSize;
+    return true;
+  }
+
+  TMD5* md5 = TMD5::FileChecksum(expfname.c_str());
+  if ( ! md5 ) {
+    std::cout << "Error: cannot read " << inFilename << std::endl;
+    return false;
+  }
+  std::string hash = md5->AsString();
+  delete md5;
+
+  if ( gSystem->AccessPathName(sOutFilename.c_str()) == 0 ) {
+    TMD5* outMd5 = TMD5::FileChecksum(sOutFilename.c_str());
+    bool isSame = ( outMd5 && hash == outMd5->AsString() );
+    delete outMd5;
+    if ( isSame ) {
+      fNstagedFiles[1]++;
+      fStagedBytes[1] += fileStat.fSize;
+      return true;
+    }
+    // Unlink rather than overwrite: the file can be a link to the cache
+    gSystem->Unlink(sOutFilename.c_str());
+  }
+
+  // The macros, sources and configuration files can be edited in the working directory:
+  // a hard link would propagate the change to the cache and to the other working directories
+  TString outName = sOutFilename.c_str();
+  if ( ! outName.EndsWith(".par") && ! outName.EndsWith(".root") ) {
+    TFile::Cp(expfname.c_str(), sOutFilename.c_str(),false);
+    fNstagedFiles[0]++;
+    fStagedBytes[0] += fileStat.fSize;
+    return true;
+  }
+
+  std::string cacheDir = gSystem->ExpandPathName(fStagingCacheDir.c_str());
+  std::string cachedFilename = Form("%s/%s",cacheDir.c_str(),hash.c_str());
+  int icopy = 1;
+  if ( gSystem->AccessPathName(cachedFilename.c_str()) == 0 ) {
+    // The entry could have been changed through a link in another working directory
+    TMD5* cachedMd5 = TMD5::FileChecksum(cachedFilename.c_str());
+    bool isGood = ( cachedMd5 && hash == cachedMd5->AsString() );
+    delete cachedMd5;
+    if ( ! isGood ) {
+      std::cout << "Warning: corrupted cache entry " << cachedFilename << ": replace it" << std::endl;
+      gSystem->Unlink(cachedFilename.c_str());
+    }
+  }
+  if ( gSystem->AccessPathName(cachedFilename.c_str()) ) {
+    gSystem->mkdir(cacheDir.c_str(),true);
+    std::string tmpFilename = Form("%s.%i",cachedFilename.c_str(),gSystem->GetPid());
+    TFile::Cp(expfname.c_str(), tmpFilename.c_str(),false);
+    // The cached files are shared by all of the working directories: they must not be changed in place
+    gSystem->Chmod(tmpFilename.c_str(),0444);
+    gSystem->Rename(tmpFilename.c_str(),cachedFilename.c_str());
+    icopy = 0;
+  }
+
+  if ( gSystem->Link(cachedFilename.c_str(),sOutFilename.c_str()) != 0 ) {
+    // The cache is on another file system
+    TFile::Cp(expfname.c_str(), sOutFilename.c_str(),false);
+    icopy = 0;
+  }
+  fNstagedFiles[icopy]++;
+  fStagedBytes[icopy] += fileStat.fSize;
 
   return true;
 }
 
+//_______________________________________________________
+TChain* AliTaskSubmitter::CreateLocalChain ( const std::vector<std::string>& files, TObject*& prefetcher ) const
+{
+  /// Create the chain of the input files for the local modes.
+  /// If the prefetch is enabled, the remote files are read from the prefetch cache
+  /// and the prefetcher (which must be deleted after the analysis) is returned
+  std::string treeName = ( fFileType == kAOD ) ? "aodTree" : "esdTree";
+  TChain* chain = new TChain(treeName.c_str());
+  prefetcher = nullptr;
+  if ( fPrefetchFiles <= 0 ) {
+    for ( auto& str : files ) chain->Add(str.c_str());
+    return chain;
+  }
+  // Files read by the handlers from the directory of each input:
+  // they are downloaded with it, so that the cached input is read with them
+  std::vector<AliInputPrefetcher::Sibling> siblings;
+  AliAnalysisManager* mgr = AliAnalysisManager::GetAnalysisManager();
+  if ( mgr && mgr->GetMCtruthEventHandler() ) {
+    siblings.push_back(AliInputPrefetcher::Sibling("galice.root",true));
+    siblings.push_back(AliInputPrefetcher::Sibling("Kinematics.root",true));
+    siblings.push_back(AliInputPrefetcher::Sibling("TrackRefs.root",false));
+  }
+  AliESDInputHandler* esdH = mgr ? dynamic_cast<AliESDInputHandler*>(mgr->GetInputEventHandler()) : nullptr;
+  if ( esdH && esdH->GetReadFriends() ) siblings.push_back(AliInputPrefetcher::Sibling("AliESDfriends.root",false));
+  for ( auto& sibling : fPrefetchSiblings ) siblings.push_back(AliInputPrefetcher::Sibling(sibling,true));
+  AliInputPrefetcher* inputPrefetcher = new AliInputPrefetcher(chain,files,siblings,fPrefetchCacheDir.c_str(),fPrefetchFiles,fPrefetchCacheSize,fPrefetchLatency);
+  inputPrefetcher->WaitFor(0);
+  prefetcher = inputPrefetcher;
+  return chain;
+}
+
 //_______________________________________________________
 void AliTaskSubmitter::CreateAlienHandler ()
 {
@@ -325,6 +1121,187 @@ std::string AliTaskSubmitter::GetGridDataPattern ( const char* queryString ) con
 }
 
 
+//______________________________________________________________________________
+std::vector<std::string> AliTaskSubmitter::GetOADBObjects () const
+{
+  /// Get the OADB objects (relative to $ALICE_PHYSICS/OADB) to put in the reduced OADB par file:
+  /// the ones referenced in the configuration, macros and sources of the working dir
+  /// and the extra ones of SetReducedOADBPar.
+  /// Empty if the full OADB is needed
+  std::vector<std::string> objects;
+  if ( ! fReducedOADBPar ) return objects;
+  TString found = gSystem->GetFromPipe(Form("cd %s && cat train.cfg *.C *.cxx *.h 2>/dev/null | grep -o 'OADB/[A-Za-z0-9_./-]*' | sort -u",fWorkDir.c_str()));
+  for ( auto& extra : fOADBExtraObjects ) found += Form("\nOADB/%s",extra.c_str());
+  TObjArray* arr = found.Tokenize("\n");
+  TIter next(arr);
+  TObject* obj = nullptr;
+  while ( (obj = next()) ) {
+    std::string objName = obj->GetName();
+    objName.erase(0,5);
+    while ( ! objName.empty() && ( objName.back() == '.' || objName.back() == '/' ) ) objName.pop_back();
+    // Keep only what exists in the OADB
+    if ( objName.empty() || gSystem->AccessPathName(Form("$ALICE_PHYSICS/OADB/%s",objName.c_str())) ) continue;
+    if ( std::find(objects.begin(),objects.end(),objName) != objects.end() ) continue;
+    objects.push_back(objName);
+  }
+  delete arr;
+  return objects;
+}
+
+//______________________________________________________________________________
+std::string AliTaskSubmitter::GetOADBObjectsKey () const
+{
+  /// Key of the OADB objects: their names, modification times and sizes
+  std::string state = "";
+  std::vector<std::string> objects = GetOADBObjects();
+  if ( objects.empty() ) objects.push_back(".");
+  for ( auto& obj : objects ) {
+    state += gSystem->GetFromPipe(Form("find $ALICE_PHYSICS/OADB/%s -type f -exec ls -ln {} +",obj.c_str())).Data();
+  }
+  TMD5 md5;
+  md5.Update(reinterpret_cast<const UChar_t*>(state.c_str()),state.size());
+  md5.Final();
+  return md5.AsString();
+}
+
+//______________________________________________________________________________
+std::vector<AliTaskSubmitter::InputShard> AliTaskSubmitter::GetShardPlan ( int nShards ) const
+{
+  /// Split the input files in shards of similar size,
+  /// with the longest-processing-time-first rule:
+  /// each file (from the largest one) goes to the shard with the smallest size.
+  /// When splitting per run (SPLIT option) each shard only contains files of one run,
+  /// and each run gets a number of shards proportional to its size.
+  /// The plan is written to shardPlan.txt and reused as long as the input list does not change
+  std::string planName = "shardPlan.txt";
+  std::vector<InputShard> shards;
+  nShards = std::max(1,nShards);
+  std::string header = Form("# nShards %i splitPerRun %i",nShards,(int)fProofSplitPerRun);
+
+  // Reuse the plan if it was made for the same input
+  if ( ! fIsInputFileCollection && gSystem->AccessPathName(planName.c_str()) == 0 ) {
+    std::ifstream inFile(planName.c_str());
+    std::string currLine;
+    std::vector<std::string> planFiles;
+    if ( std::getline(inFile,currLine) && currLine == header ) {
+      while ( std::getline(inFile,currLine) ) {
+        if ( currLine.empty() || currLine[0] == '#' ) continue;
+        std::istringstream ss(currLine);
+        size_t ishard = 0;
+        std::string run, filename;
+        Long64_t size = 0;
+        ss >> ishard >> run >> size >> filename;
+        if ( ishard >= shards.size() ) shards.resize(ishard+1);
+        shards[ishard].run = ( run == "-" ) ? "" : run;
+        shards[ishard].size += size;
+        shards[ishard].files.push_back(filename);
+        planFiles.push_back(filename);
+      }
+    }
+    inFile.close();
+    std::vector<std::string> inputFiles(fInputData);
+    std::sort(inputFiles.begin(),inputFiles.end());
+    std::sort(planFiles.begin(),planFiles.end());
+    if ( ! planFiles.empty() && planFiles == inputFiles ) {
+      std::cout << "Reusing " << planName << ": " << shards.size() << " shards" << std::endl;
+      return shards;
+    }
+    shards.clear();
+  }
+
+  // Get the file sizes
+  std::vector<std::pair<Long64_t,std::string>> files;
+  if ( fIsInputFileCollection ) {
+    TFile* file = TFile::Open(fInputData[0].c_str());
+    TFileCollection* fc = file ? static_cast<TFileCollection*>(file->Get("dataset")) : nullptr;
+    if ( fc ) {
+      TIter next(fc->GetList());
+      TFileInfo* info = nullptr;
+      while ( (info = static_cast<TFileInfo*>(next())) ) files.push_back(std::make_pair(info->GetSize(),info->GetCurrentUrl()->GetUrl()));
+    }
+    delete fc;
+    delete file;
+  }
+  else {
+    for ( auto& str : fInputData ) {
+      FileStat_t fileStat;
+      Long64_t size = ( gSystem->GetPathInfo(str.c_str(),fileStat) == 0 ) ? fileStat.fSize : -1;
+      files.push_back(std::make_pair(size,str));
+    }
+  }
+
+  // The files with unknown size (e.g. remote) are assumed to have the average size
+  Long64_t knownSize = 0, nKnown = 0;
+  for ( auto& file : files ) {
+    if ( file.first < 0 ) continue;
+    knownSize += file.first;
+    nKnown++;
+  }
+  Long64_t defaultSize = ( nKnown > 0 ) ? std::max(1LL,knownSize/nKnown) : 1;
+  Long64_t totalSize = 0;
+  std::map<std::string,std::vector<std::pair<Long64_t,std::string>>> groups;
+  for ( auto& file : files ) {
+    if ( file.first < 0 ) file.first = defaultSize;
+    totalSize += file.first;
+    std::string run = fProofSplitPerRun ? GetRunNumber(file.second.c_str()) : "";
+    groups[run].push_back(file);
+  }
+
+  for ( auto& group : groups ) {
+    std::vector<std::pair<Long64_t,std::string>>& groupFiles = group.second;
+    Long64_t groupSize = 0;
+    for ( auto& file : groupFiles ) groupSize += file.first;
+    int nGroupShards = ( fProofSplitPerRun ) ? TMath::Nint((double)nShards*groupSize/totalSize) : nShards;
+    nGroupShards = std::max(1,std::min(nGroupShards,(int)groupFiles.size()));
+    std::stable_sort(groupFiles.begin(),groupFiles.end(),[](const std::pair<Long64_t,std::string>& aa, const std::pair<Long64_t,std::string>& bb) { return aa.first > bb.first; });
+    size_t firstShard = shards.size();
+    shards.resize(firstShard+nGroupShards);
+    for ( size_t ishard=firstShard; ishard<shards.size(); ++ishard ) shards[ishard].run = group.first;
+    for ( auto& file : groupFiles ) {
+      size_t ishard = std::min_element(shards.begin()+firstShard,shards.end(),[](const InputShard& aa, const InputShard& bb) { return aa.size < bb.size; }) - shards.begin();
+      shards[ishard].files.push_back(file.second);
+      shards[ishard].size += file.first;
+    }
+  }
+
+  std::ofstream outFile(planName.c_str());
+  outFile << header << std::endl;
+  outFile << "# shard run size file" << std::endl;
+  Long64_t maxSize = 0;
+  for ( size_t ishard=0; ishard<shards.size(); ++ishard ) {
+    for ( auto& filename : shards[ishard].files ) {
+      auto found = std::find_if(files.begin(),files.end(),[&filename](const std::pair<Long64_t,std::string>& file) { return file.second == filename; });
+      outFile << ishard << "\t" << ( shards[ishard].run.empty() ? "-" : shards[ishard].run ) << "\t" << found->first << "\t" << filename << std::endl;
+    }
+    maxSize = std::max(maxSize,shards[ishard].size);
+  }
+  outFile.close();
+  if ( ! shards.empty() ) std::cout << "Split " << files.size() << " files in " << shards.size() << " shards (see " << planName << "): largest shard " << maxSize << " bytes, average " << totalSize / shards.size() << " bytes" << std::endl;
+
+  return shards;
+}
+
+//______________________________________________________________________________
+std::string AliTaskSubmitter::GetParBuildKey () const
+{
+  /// Key of the par build: revision of the AliPhysics sources
+  /// plus the content of the files changed with respect to it
+  /// (or the modification times and sizes of all files if the sources are not in git)
+  std::string srcDir = gSystem->GetFromPipe(Form("grep '^AliPhysics_SOURCE_DIR:' %s/CMakeCache.txt 2>/dev/null | cut -d = -f 2",fAliPhysicsBuildDir.c_str())).Data();
+  if ( srcDir.empty() ) srcDir = fAliPhysicsBuildDir;
+  std::string state = fAliPhysicsBuildDir;
+  TString revision = gSystem->GetFromPipe(Form("cd %s && git rev-parse HEAD 2>/dev/null",srcDir.c_str()));
+  if ( revision.IsNull() ) state += gSystem->GetFromPipe(Form("find %s -type f -not -name '*.par' -exec ls -ln {} +",srcDir.c_str())).Data();
+  else {
+    state += revision.Data();
+    state += gSystem->GetFromPipe(Form("cd %s && git diff HEAD && git ls-files -o --exclude-standard && git ls-files -o --exclude-standard | git hash-object --stdin-paths",srcDir.c_str())).Data();
+  }
+  TMD5 md5;
+  md5.Update(reinterpret_cast<const UChar_t*>(state.c_str()),state.size());
+  md5.Final();
+  return md5.AsString();
+}
+
 //______________________________________________________________________________
 std::string AliTaskSubmitter::GetGridQueryVal ( const char* queryString, const char* keyword ) const
 {
@@ -408,6 +1385,78 @@ std::string AliTaskSubmitter::GetRunNumber ( const char* checkString ) const
 
 
 
+//_______________________________________________________
+bool AliTaskSubmitter::LearnBranches () const
+{
+  /// Learn the branches read by the train.
+  /// The analysis runs on the first entries in a forked process,
+  /// with the automatic branch loading disabled, so that only the branches
+  /// declared by the tasks (and the ones they load with AliAnalysisManager::LoadBranch) are read.
+  /// A task which does not declare its branches would miss the ones it reads through InputEvent():
+  /// the branches are only learned if all of the tasks declare them.
+  /// The branch set is stored per train (see SetupBranchSet) and used in the next runs
+  if ( fBranchLearnEntries <= 0 || gSystem->AccessPathName(fBranchSetFile.c_str()) == 0 ) return false;
+  if ( ! TasksDeclareBranches() ) return false;
+  std::string currDir = gSystem->pwd();
+  std::string learnDir = Form("%s/branchLearning",currDir.c_str());
+  gSystem->Exec(Form("rm -rf %s",learnDir.c_str()));
+  gSystem->mkdir(learnDir.c_str());
+  gSystem->mkdir(gSystem->DirName(fBranchSetFile.c_str()),true);
+  std::cout << "Learning the branches read by the train on " << fBranchLearnEntries << " entries" << std::endl;
+
+  pid_t pid = fork();
+  if ( pid < 0 ) return false;
+  if ( pid == 0 ) {
+    gSystem->cd(learnDir.c_str());
+    gSystem->RedirectOutput("learning.log","w");
+    AliAnalysisManager* mgr = AliAnalysisManager::GetAnalysisManager();
+    TChain* chain = new TChain(( fFileType == kAOD ) ? "aodTree" : "esdTree");
+    for ( auto& str : fInputData ) chain->Add(str.c_str());
+    mgr->SetSkipTerminate(kTRUE);
+    mgr->SetAutoBranchLoading(kFALSE);
+    Long64_t status = mgr->StartAnalysis("local",chain,(Long64_t)fBranchLearnEntries);
+    TTree* tree = chain->GetTree();
+    if ( status < 0 || ! tree ) _exit(1);
+
+    std::function<bool(TBranch*)> isRead = [&isRead](TBranch* branch) {
+      if ( branch->GetReadEntry() >= 0 ) return true;
+      TIter next(branch->GetListOfBranches());
+      TBranch* subBranch = nullptr;
+      while ( (subBranch = static_cast<TBranch*>(next())) ) {
+        if ( isRead(subBranch) ) return true;
+      }
+      return false;
+    };
+    std::string branches;
+    Long64_t allBytes = 0, keptBytes = 0;
+    TIter next(tree->GetListOfBranches());
+    TBranch* branch = nullptr;
+    while ( (branch = static_cast<TBranch*>(next())) ) {
+      Long64_t zipBytes = branch->GetZipBytes("*");
+      allBytes += zipBytes;
+      if ( ! isRead(branch) ) continue;
+      keptBytes += zipBytes;
+      if ( ! branches.empty() ) branches += " ";
+      branches += branch->GetName();
+    }
+    gSystem->RedirectOutput(0x0);
+    if ( branches.empty() ) _exit(2);
+    std::string tmpName = Form("%s.%i",fBranchSetFile.c_str(),gSystem->GetPid());
+    std::ofstream outFile(tmpName.c_str());
+    outFile << "# " << tree->GetEntries() << " " << allBytes << " " << keptBytes << std::endl;
+    outFile << branches << std::endl;
+    outFile.close();
+    _exit(gSystem->Rename(tmpName.c_str(),fBranchSetFile.c_str()) == 0 ? 0 : 1);
+  }
+
+  int status = 0;
+  waitpid(pid,&status,0);
+  int exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+  if ( exitCode == 2 ) std::cout << "Warning: no branch is declared or loaded by the tasks: all branches are read" << std::endl;
+  else if ( exitCode != 0 ) std::cout << "Warning: cannot learn the branches read by the train (see " << learnDir << "/learning.log): all branches are read" << std::endl;
+  return ( exitCode == 0 && ApplyBranchSet() );
+}
+
 //_______________________________________________________
 bool AliTaskSubmitter::Load() const
 {
@@ -415,18 +1464,27 @@ bool AliTaskSubmitter::Load() const
 
   bool loadProof = ( fRunMode == kProofSaf2 || fIsPodMachine );
 
+  std::vector<std::pair<std::string,double>> phases;
+  TStopwatch sw;
+
   if ( loadProof ) {
     if ( ! LoadProof() ) return false;
+    AddStartupPhase(phases,"proof",sw);
   }
   else {
     // Load locally
     for ( auto& str : fPackages ) AliAnalysisAlien::SetupPar(str.c_str());
-    for ( auto& str : fSources ) gInterpreter->ProcessLine(Form(".L %s+",str.c_str()));
-    for ( auto& entry : fUtilityMacros ) {
-      if ( entry.second == 1 ) {
-        gInterpreter->ProcessLine(Form(".L %s+",entry.first.c_str()));
+    AddStartupPhase(phases,"packages",sw);
+    if ( fStagingCacheDir.empty() ) {
+      for ( auto& str : fSources ) gInterpreter->ProcessLine(Form(".L %s+",str.c_str()));
+      for ( auto& entry : fUtilityMacros ) {
+        if ( entry.second == 1 ) {
+          gInterpreter->ProcessLine(Form(".L %s+",entry.first.c_str()));
+        }
       }
     }
+    else if ( ! LoadCompiledSources() ) return false;
+    AddStartupPhase(phases,"sources",sw);
   }
 
 
@@ -438,6 +1496,10 @@ bool AliTaskSubmitter::Load() const
       std::cout << "Error: Cannot load all libraries for module " << cfg.GetName() << std::endl;
       return false;
     }
+  }
+  AddStartupPhase(phases,"libraries",sw);
+
+  for ( auto& cfg : fTasks ) {
     // Execute the macro
    if (cfg.ExecuteMacro()<0) {
       std::cout << "Error: executing the macro " << cfg.GetMacroName() << " with arguments: " << cfg.GetMacroArgs() << " for module " << cfg.GetName() << " returned a negative value" << std::endl;
@@ -449,6 +1511,7 @@ bool AliTaskSubmitter::Load() const
       return kFALSE;
    }
   }
+  AddStartupPhase(phases,"tasks",sw);
 
   if ( IsGrid() ) {
     // // In principle, the additional sources should be passed to the jdl
@@ -471,7 +1534,16 @@ bool AliTaskSubmitter::Load() const
       gInterpreter->ProcessLine(Form("TString inputOpts; SetAlienIO(inputOpts,\"%s\",(AliAnalysisAlien*)%p)",fPeriod.c_str(),fPlugin));
       gSystem->Unload("SetAlienIO.C");
     }
+    AddStartupPhase(phases,"alien IO",sw);
+  }
+
+  double totalTime = 0.;
+  std::cout << "Startup time:";
+  for ( auto& phase : phases ) {
+    std::cout << " " << phase.first << " " << phase.second << " s,";
+    totalTime += phase.second;
   }
+  std::cout << " total " << totalTime << " s" << std::endl;
 
 
   // // Unload the utility macros
@@ -484,6 +1556,156 @@ bool AliTaskSubmitter::Load() const
   return true;
 }
 
+//_______________________________________________________
+bool AliTaskSubmitter::LoadCompiledSources() const
+{
+  /// Load the sources and the utility macros compiled with ACLiC.
+  /// The libraries are cached, keyed on the content of the source (and header),
+  /// the include paths, the ROOT and AliPhysics versions
+  /// and the keys of the other sources that it includes.
+  /// Only the sources which are not in the cache are compiled:
+  /// the independent ones in parallel, with one root process each
+  struct Source {
+    std::string path; ///< Absolute path
+    std::string stem; ///< Name without extension
+    std::string content; ///< Content of source and header
+    std::string key; ///< Cache key
+    std::string lib; ///< Cached library
+    std::vector<size_t> deps; ///< Sources included by this one
+    bool isDone = false; ///< Compiled or in cache
+  };
+
+  std::vector<Source> sources;
+  std::vector<std::string> names(fSources);
+  for ( auto& entry : fUtilityMacros ) {
+    if ( entry.second == 1 ) names.push_back(entry.first);
+  }
+  std::string currDir = gSystem->pwd();
+  for ( auto& name : names ) {
+    Source src;
+    // Use the copy staged in the working directory if it is there
+    std::string baseName = gSystem->BaseName(name.c_str());
+    src.path = ( gSystem->AccessPathName(baseName.c_str()) == 0 ) ? currDir + "/" + baseName : gSystem->ExpandPathName(name.c_str());
+    src.stem = baseName.substr(0,baseName.find_last_of("."));
+    std::string header = src.path.substr(0,src.path.find_last_of(".")) + ".h";
+    for ( auto& fname : { src.path, header } ) {
+      std::ifstream inFile(fname.c_str());
+      if ( ! inFile.is_open() ) continue;
+      std::stringstream ss;
+      ss << inFile.rdbuf();
+      src.content += ss.str();
+    }
+    if ( src.content.empty() ) {
+      std::cout << "Error: cannot read " << name << std::endl;
+      return false;
+    }
+    sources.push_back(src);
+  }
+  for ( auto& src : sources ) {
+    for ( size_t idep=0; idep<sources.size(); ++idep ) {
+      if ( sources[idep].stem != src.stem && src.content.find("\"" + sources[idep].stem + ".h\"") != std::string::npos ) src.deps.push_back(idep);
+    }
+  }
+
+  const char* aliPhysics = gSystem->Getenv("ALICE_PHYSICS");
+  std::string environment = Form("%s\n%s\n%s\n%s\n%s\n",gROOT->GetVersion(),gSystem->GetIncludePath(),gSystem->GetFlagsOpt(),gSystem->GetMakeSharedLib(),aliPhysics ? aliPhysics : "");
+  // A rebuilt AliPhysics changes the newest installed header
+  if ( aliPhysics ) environment += gSystem->GetFromPipe("ls -lt $ALICE_PHYSICS/include 2>/dev/null | sed -n 2p").Data();
+
+  std::string cacheDir = gSystem->ExpandPathName(Form("%s/aclic",fStagingCacheDir.c_str()));
+  TString includePath = gSystem->GetIncludePath();
+  includePath.ReplaceAll("\"","\\\"");
+
+  // Process the sources by waves: each wave contains the sources whose dependencies are done
+  std::vector<size_t> loadOrder;
+  int nCompiled = 0;
+  TStopwatch compileTime;
+  compileTime.Stop();
+  while ( loadOrder.size() < sources.size() ) {
+    std::vector<size_t> wave;
+    for ( size_t isrc=0; isrc<sources.size(); ++isrc ) {
+      if ( sources[isrc].isDone ) continue;
+      bool isReady = true;
+      for ( size_t idep : sources[isrc].deps ) {
+        if ( ! sources[idep].isDone ) isReady = false;
+      }
+      if ( isReady ) wave.push_back(isrc);
+    }
+    if ( wave.empty() ) {
+      // Circular includes: compile the remaining sources together
+      for ( size_t isrc=0; isrc<sources.size(); ++isrc ) {
+        if ( ! sources[isrc].isDone ) wave.push_back(isrc);
+      }
+    }
+
+    std::vector<std::string> commands;
+    std::vector<size_t> toCompile;
+    for ( size_t isrc : wave ) {
+      Source& src = sources[isrc];
+      std::string keyString = environment + src.content;
+      for ( size_t idep : src.deps ) keyString += sources[idep].key;
+      TMD5 md5;
+      md5.Update(reinterpret_cast<const UChar_t*>(keyString.c_str()),keyString.size());
+      md5.Final();
+      src.key = md5.AsString();
+      std::string libName = gSystem->BaseName(src.path.c_str());
+      libName.replace(libName.find_last_of("."),1,"_");
+      libName += Form(".%s",gSystem->GetSoExt());
+      std::string libDir = Form("%s/%s",cacheDir.c_str(),src.key.c_str());
+      src.lib = libDir + "/" + libName;
+      if ( gSystem->AccessPathName(src.lib.c_str()) == 0 ) continue;
+
+      // Compile in a temporary directory, moved into the cache when done
+      std::string tmpDir = Form("%s.%i",libDir.c_str(),gSystem->GetPid());
+      gSystem->mkdir(tmpDir.c_str(),true);
+      std::ofstream outFile(Form("%s/compile.C",tmpDir.c_str()));
+      outFile << "{" << std::endl;
+      outFile << "  gSystem->SetIncludePath(\"" << includePath.Data() << "\");" << std::endl;
+      for ( auto& lib : fLibraries ) outFile << "  gSystem->Load(\"lib" << lib << "\");" << std::endl;
+      for ( size_t idep : src.deps ) outFile << "  gSystem->Load(\"" << sources[idep].lib << "\");" << std::endl;
+      outFile << "  gSystem->CompileMacro(\"" << src.path << "\",\"k\",\"" << tmpDir << "/" << libName << "\");" << std::endl;
+      outFile << "}" << std::endl;
+      outFile.close();
+      commands.push_back(Form("cd %s && root.exe -l -b -q compile.C > compile.log 2>&1 && mv %s %s",tmpDir.c_str(),tmpDir.c_str(),libDir.c_str()));
+      toCompile.push_back(isrc);
+    }
+
+    if ( ! toCompile.empty() ) {
+      compileTime.Start(false);
+      std::atomic<size_t> next(0);
+      auto worker = [&]() {
+        for ( size_t icmd = next++; icmd < commands.size(); icmd = next++ ) {
+          gSystem->Exec(commands[icmd].c_str());
+        }
+      };
+      int nWorkers = std::max(1,std::min((int)std::thread::hardware_concurrency(),(int)commands.size()));
+      std::vector<std::thread> workers;
+      for ( int iworker=0; iworker<nWorkers; ++iworker ) workers.emplace_back(worker);
+      for ( auto& thr : workers ) thr.join();
+      compileTime.Stop();
+    }
+
+    for ( size_t isrc : wave ) {
+      if ( gSystem->AccessPathName(sources[isrc].lib.c_str()) ) {
+        std::cout << "Error: cannot compile " << sources[isrc].path << ". See " << gSystem->DirName(sources[isrc].lib.c_str()) << "." << gSystem->GetPid() << "/compile.log" << std::endl;
+        return false;
+      }
+      sources[isrc].isDone = true;
+      loadOrder.push_back(isrc);
+    }
+    nCompiled += toCompile.size();
+  }
+
+  for ( size_t isrc : loadOrder ) {
+    if ( gSystem->Load(sources[isrc].lib.c_str()) < 0 ) {
+      std::cout << "Error: cannot load " << sources[isrc].lib << std::endl;
+      return false;
+    }
+  }
+  std::cout << "Loaded " << sources.size() << " sources: " << sources.size() - nCompiled << " from cache, " << nCompiled << " compiled in " << compileTime.RealTime() << " s" << std::endl;
+  return true;
+}
+
 //_______________________________________________________
 bool AliTaskSubmitter::LoadProof() const
 {
@@ -559,19 +1781,142 @@ bool AliTaskSubmitter::LoadProof() const
     gProof->EnablePackage(str.c_str(),notOnClient);
   }
 
+  // The client loads the sources from the cache of compiled libraries
+  bool sourcesNotOnClient = ! fStagingCacheDir.empty();
+  if ( sourcesNotOnClient && ! LoadCompiledSources() ) return false;
+
   for ( auto& str : fSources ) {
-    gProof->Load(Form("%s+g",str.c_str()),notOnClient);
+    gProof->Load(Form("%s+g",str.c_str()),sourcesNotOnClient);
   }
 
   for ( auto& entry : fUtilityMacros ) {
     if ( entry.second == 1 ) {
-      gProof->Load(Form("%s+g",entry.first.c_str()),notOnClient);
+      gProof->Load(Form("%s+g",entry.first.c_str()),sourcesNotOnClient);
     }
   }
 
   return true;
 }
 
+//_______________________________________________________
+bool AliTaskSubmitter::MergeGridOutputs () const
+{
+  /// Download the merged outputs of the runs from the grid
+  /// and merge them while they arrive (see AliStreamingMerger).
+  /// All of the output files of the analysis manager are merged.
+  /// If the outputs of some runs are missing, nothing is merged and Terminate is not run
+  AliAnalysisManager* mgr = AliAnalysisManager::GetAnalysisManager();
+  if ( ! gGrid ) TGrid::Connect("alien://");
+  if ( ! gGrid ) {
+    std::cout << "Error: cannot connect to the grid" << std::endl;
+    return false;
+  }
+  std::string gridOutDir = Form("%s%s/%s",gGrid->GetHomeDirectory(),fGridWorkingDir.c_str(),fPlugin->GetGridOutputDir());
+  // Output files of the containers (name.root:folder)
+  std::set<std::string> outFilenames;
+  TIter nextContainer(mgr->GetOutputs());
+  AliAnalysisDataContainer* container = nullptr;
+  while ( (container = static_cast<AliAnalysisDataContainer*>(nextContainer())) ) {
+    std::string filename = container->GetFileName();
+    filename = filename.substr(0,filename.find(':'));
+    if ( ! filename.empty() ) outFilenames.insert(filename);
+  }
+  if ( outFilenames.empty() ) outFilenames.insert(mgr->GetCommonFileName());
+
+  AliStreamingMerger merger(".","streamingMerge",fStreamMergeJobs,fStreamMergePoll);
+  // The alien accesses are not thread safe: the downloads are serialized,
+  // while the merging goes on with the downloaded runs
+  std::mutex alienMutex;
+  std::set<std::string> runs;
+  for ( auto& filename : fInputData ) {
+    std::string currRun = GetRunNumber(filename.c_str());
+    if ( currRun.empty() || ! runs.insert(currRun).second ) continue;
+    std::string runDir = fIsMC ? currRun : "000" + currRun;
+    std::string remoteDir = Form("alien://%s/%s",gridOutDir.c_str(),runDir.c_str());
+    std::string localDir = Form("gridOutputs/%s",runDir.c_str());
+    merger.AddSource(runDir.c_str(),[remoteDir,localDir,outFilenames,&alienMutex](std::vector<std::string>& files) {
+      gSystem->mkdir(localDir.c_str(),true);
+      for ( auto& outFilename : outFilenames ) {
+        std::string localName = localDir + "/" + outFilename;
+        // Already downloaded in a previous attempt
+        if ( gSystem->AccessPathName(localName.c_str()) != 0 ) {
+          std::string tmpName = localName + ".part";
+          bool isCopied = false;
+          {
+            std::lock_guard<std::mutex> lock(alienMutex);
+            isCopied = TFile::Cp(Form("%s/%s",remoteDir.c_str(),outFilename.c_str()),tmpName.c_str(),false);
+          }
+          if ( ! isCopied || gSystem->Rename(tmpName.c_str(),localName.c_str()) != 0 ) {
+            gSystem->Unlink(tmpName.c_str());
+            return false;
+          }
+        }
+        files.push_back(localName);
+      }
+      return true;
+    });
+  }
+  if ( runs.empty() ) {
+    std::cout << "Error: no run found in the input" << std::endl;
+    return false;
+  }
+
+  // The jobs are over in kGridTerminate: the missing outputs are not waited for
+  merger.Run([]() { return true; });
+  merger.Print();
+  if ( ! merger.GetFailed().empty() ) {
+    // A partial result would look like the full one: it is renamed
+    std::cout << "Error: the outputs of " << merger.GetFailed().size() << " runs are missing: Terminate is not run. Remove these runs from the input to terminate without them" << std::endl;
+    for ( auto& outFilename : outFilenames ) {
+      if ( gSystem->AccessPathName(outFilename.c_str()) == 0 ) gSystem->Rename(outFilename.c_str(),Form("%s.partial",outFilename.c_str()));
+    }
+    return false;
+  }
+  bool isOk = true;
+  for ( auto& outFilename : outFilenames ) {
+    if ( gSystem->AccessPathName(outFilename.c_str()) == 0 ) continue;
+    std::cout << "Error: cannot merge " << outFilename << std::endl;
+    isOk = false;
+  }
+  return isOk;
+}
+
+//_______________________________________________________
+void AliTaskSubmitter::PrintReadStats ( TChain* chain, double realTime, bool record ) const
+{
+  /// Print the bytes read and the time per entry.
+  /// The runs are recorded per train (see SetupBranchSet),
+  /// so that the runs with the learned branches are compared with the ones reading all branches
+  Long64_t nEntries = chain->GetReadEntry() + 1;
+  if ( nEntries <= 0 || fBranchSetFile.empty() ) return;
+  Long64_t bytesRead = TFile::GetFileBytesRead();
+  bool isPruned = ( fBranchLearnEntries > 0 && gSystem->AccessPathName(fBranchSetFile.c_str()) == 0 );
+  std::cout << "Read " << bytesRead / 1024. / 1024. << " MB in " << realTime << " s for " << nEntries << " entries (" << bytesRead / nEntries << " bytes/entry, " << 1000. * realTime / nEntries << " ms/entry)" << std::endl;
+
+  std::string statsFilename = fBranchSetFile;
+  statsFilename.replace(statsFilename.size()-4,4,".stats");
+  double refBytes = 0., refTime = 0.;
+  std::ifstream inFile(statsFilename.c_str());
+  int pruned = 0;
+  Long64_t entries = 0, bytes = 0;
+  double seconds = 0.;
+  while ( inFile >> pruned >> entries >> bytes >> seconds ) {
+    if ( pruned == 0 && entries > 0 ) {
+      refBytes = (double)bytes / entries;
+      refTime = seconds / entries;
+    }
+  }
+  inFile.close();
+  if ( isPruned && refTime > 0. ) {
+    std::cout << "With all branches: " << (Long64_t)refBytes << " bytes/entry, " << 1000. * refTime << " ms/entry. Saved " << 100. * ( 1. - bytesRead / nEntries / refBytes ) << "% of the bytes and " << 100. * ( 1. - realTime / nEntries / refTime ) << "% of the time" << std::endl;
+  }
+
+  if ( ! record ) return;
+  gSystem->mkdir(gSystem->DirName(statsFilename.c_str()),true);
+  std::ofstream outFile(statsFilename.c_str(),std::ios::app);
+  outFile << isPruned << " " << nEntries << " " << bytesRead << " " << realTime << std::endl;
+}
+
 //_______________________________________________________
 int AliTaskSubmitter::ReplaceKeywords ( std::string& input ) const
 {
@@ -622,16 +1967,23 @@ bool AliTaskSubmitter::Run ( int runMode, const char* inputName, const char* inp
   fWorkDir = ".";
   fTaskOptions = taskOptions;
   SetSoftVersion ( softVersions );
+
+  // Setup train
+  std::string anOpts(analysisOptions);
+  std::transform(anOpts.begin(), anOpts.end(), anOpts.begin(), ::toupper);
+  SetProofSplitPerRun( anOpts.find("SPLIT") != std::string::npos );
+  TString prefetchStr = TString(anOpts.c_str())(TRegexp("PREFETCH=[0-9]+"));
+  if ( ! prefetchStr.IsNull() ) {
+    prefetchStr.ReplaceAll("PREFETCH=","");
+    fPrefetchFiles = prefetchStr.Atoi();
+  }
+
   // Parse inputs
   if ( ! SetInput(inputName,inputOptions) ) return false;
   SetupProof(analysisOptions);
   if ( IsPod() && ! fIsPodMachine ) WriteRunScript (runMode, inputOptions, analysisOptions, taskOptions,  isMuonAnalysis);
 
 
-  // Setup train
-  std::string anOpts(analysisOptions);
-  std::transform(anOpts.begin(), anOpts.end(), anOpts.begin(), ::toupper);
-
   // Parse tasks and add them to the list
   if ( anOpts.find("NOPHYSSEL") == std::string::npos ) {
     fHasPhysSelInfo = true;
@@ -653,10 +2005,152 @@ bool AliTaskSubmitter::Run ( int runMode, const char* inputName, const char* inp
   // Setup the tasks and add them to the plugin
   SetupTasks();
 
+  // Once the tasks are known
+  SetupBranchSet(analysisOptions, isMuonAnalysis);
+
   std::cout << "Analyzing " << (( fFileType == kAOD ) ? "AODs" : "ESDs") << "  MC " << fIsMC << std::endl;
 
   StartAnalysis();
 
+  // The TTreeCache setting of ApplyBranchSet is global: restore it
+  if ( fTreeCacheLearnEntries >= 0 ) {
+    TTreeCache::SetLearnEntries(fTreeCacheLearnEntries);
+    fTreeCacheLearnEntries = -1;
+  }
+
+  return true;
+}
+
+//_______________________________________________________
+bool AliTaskSubmitter::RunLocalParallel () const
+{
+  /// Run the analysis locally with several processes.
+  /// The input files are split in shards of similar size (see GetShardPlan).
+  /// The process is forked once per shard: each worker runs the analysis manager
+  /// (already configured from train.cfg) on its shard, in its own directory, without Terminate.
+  /// At most nWorkers run at the same time.
+  /// The outputs are then merged (also per run with the SPLIT option) and Terminate is executed once
+  AliAnalysisManager* mgr = AliAnalysisManager::GetAnalysisManager();
+  int nWorkers = ( fLocalNworkers > 0 ) ? fLocalNworkers : std::thread::hardware_concurrency();
+  std::vector<InputShard> shards = GetShardPlan(nWorkers);
+  int nShards = shards.size();
+  if ( nShards == 0 ) {
+    std::cout << "Error: no input data" << std::endl;
+    return false;
+  }
+  nWorkers = std::max(1,std::min(nWorkers,nShards));
+  std::string currDir = gSystem->pwd();
+
+  TStopwatch sw;
+  bool isOk = true;
+  std::map<pid_t,int> running;
+  auto waitWorker = [&]() {
+    int status = 0;
+    pid_t pid = wait(&status);
+    auto found = running.find(pid);
+    if ( found == running.end() ) return;
+    if ( ! WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+      std::cout << "Error: worker " << found->second << " failed. See " << currDir << "/worker" << found->second << "/worker.log" << std::endl;
+      isOk = false;
+    }
+    running.erase(found);
+  };
+
+  for ( int ishard=0; ishard<nShards; ++ishard ) {
+    while ( (int)running.size() >= nWorkers ) waitWorker();
+    std::string workerDir = Form("%s/worker%i",currDir.c_str(),ishard);
+    gSystem->Exec(Form("rm -rf %s",workerDir.c_str()));
+    gSystem->mkdir(workerDir.c_str());
+    pid_t pid = fork();
+    if ( pid < 0 ) {
+      std::cout << "Error: cannot start worker " << ishard << std::endl;
+      isOk = false;
+      break;
+    }
+    if ( pid == 0 ) {
+      // Worker
+      gSystem->cd(workerDir.c_str());
+      gSystem->RedirectOutput("worker.log","w");
+      TStopwatch workerSw;
+      TObject* prefetcher = nullptr;
+      TChain* chain = CreateLocalChain(shards[ishard].files,prefetcher);
+      mgr->SetSkipTerminate(kTRUE);
+      Long64_t status = mgr->StartAnalysis("local",chain);
+      if ( prefetcher ) prefetcher->Print();
+      delete prefetcher;
+      PrintReadStats(chain,workerSw.RealTime(),false);
+      std::ofstream outFile("timing.txt");
+      outFile << workerSw.RealTime() << std::endl;
+      outFile.close();
+      gSystem->RedirectOutput(0x0);
+      // Do not run the destructors of the objects copied from the parent
+      _exit(status < 0 ? 1 : 0);
+    }
+    running[pid] = ishard;
+  }
+  while ( ! running.empty() ) waitWorker();
+  double processTime = sw.RealTime();
+  if ( ! isOk ) return false;
+
+  // The kLocal time is estimated as the sum of the worker times
+  double serialTime = 0.;
+  for ( int ishard=0; ishard<nShards; ++ishard ) {
+    std::ifstream inFile(Form("worker%i/timing.txt",ishard));
+    double workerTime = 0.;
+    if ( inFile >> workerTime ) serialTime += workerTime;
+  }
+
+  // Merge the outputs
+  sw.Start(true);
+  auto mergeOutputs = [](const char* outDir, const std::vector<std::string>& inDirs) {
+    TString outputs = gSystem->GetFromPipe(Form("cd %s && ls *.root 2>/dev/null",inDirs[0].c_str()));
+    TObjArray* arr = outputs.Tokenize("\n");
+    TIter next(arr);
+    TObject* obj = nullptr;
+    bool isMerged = true;
+    while ( (obj = next()) ) {
+      TFileMerger merger(false);
+      merger.SetPrintLevel(0);
+      merger.OutputFile(Form("%s/%s",outDir,obj->GetName()));
+      for ( auto& inDir : inDirs ) {
+        std::string filename = Form("%s/%s",inDir.c_str(),obj->GetName());
+        if ( gSystem->AccessPathName(filename.c_str()) == 0 ) merger.AddFile(filename.c_str(),false);
+      }
+      if ( ! merger.Merge() ) {
+        std::cout << "Error: cannot merge " << obj->GetName() << " in " << outDir << std::endl;
+        isMerged = false;
+      }
+    }
+    delete arr;
+    return isMerged;
+  };
+
+  std::map<std::string,std::vector<std::string>> runDirs;
+  for ( int ishard=0; ishard<nShards; ++ishard ) runDirs[shards[ishard].run].push_back(Form("worker%i",ishard));
+  std::vector<std::string> mergeDirs;
+  if ( fProofSplitPerRun ) {
+    // Output per run
+    for ( auto& entry : runDirs ) {
+      std::string runDir = entry.first.empty() ? "unknownRun" : entry.first;
+      gSystem->mkdir(runDir.c_str());
+      if ( ! mergeOutputs(runDir.c_str(),entry.second) ) isOk = false;
+      mergeDirs.push_back(runDir);
+    }
+  }
+  else mergeDirs = runDirs[""];
+  if ( isOk && ! mergeOutputs(".",mergeDirs) ) isOk = false;
+  double mergeTime = sw.RealTime();
+  if ( ! isOk ) return false;
+
+  // Same as kLocalTerminate
+  sw.Start(true);
+  mgr->SetSkipTerminate(kFALSE);
+  mgr->StartAnalysis("grid terminate");
+  double terminateTime = sw.RealTime();
+
+  double speedup = ( processTime > 0. ) ? serialTime / processTime : 0.;
+  std::cout << "Parallel local run of " << nShards << " shards with " << nWorkers << " workers: processing " << processTime << " s, merging " << mergeTime << " s, terminate " << terminateTime << " s" << std::endl;
+  std::cout << "Estimated kLocal processing time " << serialTime << " s: speedup " << speedup << ", efficiency " << 100. * speedup / nWorkers << "%" << std::endl;
   return true;
 }
 
@@ -669,7 +2163,51 @@ bool AliTaskSubmitter::RunPod () const
   std::string command = Form("%s %s %s ./ %s/",fProofCopyCommand.c_str(),syncOpt.c_str(),baseExclude.c_str(),remoteDir.c_str());
   gSystem->Exec(command.c_str());
   std::string updateVersion = Form("sed -i \"s/VafAliPhysicsVersion=.*/VafAliPhysicsVersion=%s/\" .vaf/vaf.conf",fSoftVersion.c_str());
-  int exitCode = gSystem->Exec(Form("%s '%s; %s'",fProofOpenCommand.c_str(),updateVersion.c_str(),fProofExecCommand.c_str()));
+  std::string execCommand = Form("%s '%s; %s'",fProofOpenCommand.c_str(),updateVersion.c_str(),fProofExecCommand.c_str());
+
+  if ( fProofSplitPerRun && fStreamMergeJobs > 0 ) {
+    // The output of each run is copied back and merged as soon as the run is done,
+    // while the other runs are analysed
+    int exitCode = 0;
+    std::atomic<bool> isDone(false);
+    std::thread execThread([&]() {
+      exitCode = gSystem->Exec(execCommand.c_str());
+      isDone = true;
+    });
+    AliStreamingMerger merger(".","streamingMerge",fStreamMergeJobs,fStreamMergePoll);
+    std::set<std::string> runs;
+    for ( auto& shard : GetShardPlan(1) ) {
+      if ( ! shard.run.empty() ) runs.insert(shard.run);
+    }
+    std::string copyCommand = fProofCopyCommand;
+    for ( auto& run : runs ) {
+      merger.AddSource(run.c_str(),[copyCommand,remoteDir,run](std::vector<std::string>& files) {
+        // The run script marks the runs which are done
+        gSystem->mkdir(run.c_str());
+        if ( gSystem->Exec(TString::Format("%s %s/%s/.done %s/ > /dev/null 2>&1",copyCommand.c_str(),remoteDir.c_str(),run.c_str(),run.c_str())) != 0 ) return false;
+        if ( gSystem->Exec(TString::Format("%s %s/%s/*.root %s/",copyCommand.c_str(),remoteDir.c_str(),run.c_str(),run.c_str())) != 0 ) return false;
+        TString outputs = gSystem->GetFromPipe(TString::Format("ls %s/*.root 2>/dev/null | grep -v '/dataset.root$'",run.c_str()));
+        TObjArray* arr = outputs.Tokenize("\n");
+        for ( int iobj=0; iobj<arr->GetEntriesFast(); ++iobj ) files.push_back(arr->At(iobj)->GetName());
+        delete arr;
+        return true;
+      });
+    }
+    bool isMerged = merger.Run([&isDone]() { return isDone.load(); });
+    execThread.join();
+    merger.Print();
+    if ( exitCode != 0 ) {
+      std::cout << "Error in the execution on PoD" << std::endl;
+      return false;
+    }
+    if ( ! isMerged ) {
+      std::cout << "Cannot get analysis output from PoD" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  int exitCode = gSystem->Exec(execCommand.c_str());
 
   if ( exitCode != 0 ) {
     std::cout << "Error in the execution on PoD" << std::endl;
@@ -678,6 +2216,10 @@ bool AliTaskSubmitter::RunPod () const
 
   /// Get Pod output from the server and copy it locally
   exitCode = gSystem->Exec(Form("%s %s/*.root ./",fProofCopyCommand.c_str(),remoteDir.c_str()));
+  if ( exitCode == 0 && fProofSplitPerRun ) {
+    // Output per run
+    exitCode = gSystem->Exec(Form("%s --include='[0-9]*/' --exclude='[0-9]*/dataset.root' --include='[0-9]*/*.root' --exclude='*' %s/ ./",fProofCopyCommand.c_str(),remoteDir.c_str()));
+  }
 
   if ( exitCode != 0 ) {
     std::cout << "Cannot get analysis output from PoD" << std::endl;
@@ -711,6 +2253,7 @@ void AliTaskSubmitter::SetupHandlers ( const char* analysisOptions, bool isMuonA
   else {
     AliESDInputHandler* esdH = new AliESDInputHandler();
     if ( isMuonAnalysis ) {
+      // Used until the branches read by the train are learned (see ApplyBranchSet)
       esdH->SetReadFriends(kFALSE);
       esdH->SetInactiveBranches("*");
       esdH->SetActiveBranches("MuonTracks MuonClusters MuonPads AliESDRun. AliESDHeader. AliMultiplicity. AliESDFMD. AliESDVZERO. AliESDTZERO. SPDVertex. PrimaryVertex. AliESDZDC. SPDPileupVertices");
@@ -739,12 +2282,52 @@ void AliTaskSubmitter::SetupHandlers ( const char* analysisOptions, bool isMuonA
     mgr->SetInputEventHandler(handler);
     if ( mcHandler ) mgr->SetMCtruthEventHandler(mcHandler);
   }
+
+  // Branches read by the train (see SetupBranchSet) and TTreeCache
+  TString anOptsUp(analysisOptions);
+  anOptsUp.ToUpper();
+  if ( anOptsUp.Contains("PRUNE") && fBranchLearnEntries <= 0 ) fBranchLearnEntries = 1000;
+  TString optStr = anOptsUp(TRegexp("PRUNE=[0-9]+"));
+  if ( ! optStr.IsNull() ) fBranchLearnEntries = TString(optStr(6,optStr.Length())).Atoi();
+  optStr = anOptsUp(TRegexp("TREECACHE=[0-9]+"));
+  if ( ! optStr.IsNull() ) fTreeCacheSize = TString(optStr(10,optStr.Length())).Atoll() * 1024 * 1024;
+  if ( fTreeCacheSize > 0 ) mgr->SetCacheSize(fTreeCacheSize);
+}
+
+//_______________________________________________________
+void AliTaskSubmitter::SetupBranchSet ( const char* analysisOptions, bool isMuonAnalysis )
+{
+  /// Set the file of the branches read by the train and apply them if they are known.
+  /// The branch set is keyed on the tasks attached to the manager
+  /// (including physics selection and centrality), with the branches they declare,
+  /// on train.cfg, on the input type and on the options changing the handlers
+  std::ifstream trainCfg("train.cfg");
+  std::string keyContent((std::istreambuf_iterator<char>(trainCfg)),std::istreambuf_iterator<char>());
+  keyContent += Form("\n%i %i",fFileType,isMuonAnalysis);
+  TString anOptsUp(analysisOptions);
+  anOptsUp.ToUpper();
+  for ( auto opt : { "NOPHYSSEL", "OLDCENTR", "CENTR", "MIXING" } ) keyContent += Form(" %s=%i",opt,(int)anOptsUp.Contains(opt));
+  TIter next(AliAnalysisManager::GetAnalysisManager()->GetTasks());
+  AliAnalysisTask* task = nullptr;
+  while ( (task = static_cast<AliAnalysisTask*>(next())) ) keyContent += Form("\n%s %s",task->GetName(),task->GetBranches());
+  TMD5 md5;
+  md5.Update(reinterpret_cast<const UChar_t*>(keyContent.c_str()),keyContent.size());
+  md5.Final();
+  std::string stagingCacheDir = fStagingCacheDir.empty() ? Form("%s/.taskSubmitterCache",gSystem->HomeDirectory()) : gSystem->ExpandPathName(fStagingCacheDir.c_str());
+  fBranchSetFile = Form("%s/branches/%s.txt",stagingCacheDir.c_str(),md5.AsString());
+
+  if ( fBranchLearnEntries <= 0 ) return;
+  if ( anOptsUp.Contains("RELEARN") ) gSystem->Unlink(fBranchSetFile.c_str());
+  if ( gSystem->AccessPathName(fBranchSetFile.c_str()) == 0 ) ApplyBranchSet();
+  else if ( fRunMode != kLocal && fRunMode != kLocalParallel ) std::cout << "Warning: the branches read by the train can be learned only in kLocal and kLocalParallel mode: all branches are read" << std::endl;
 }
 
 //_______________________________________________________
 bool AliTaskSubmitter::SetupLocalWorkDir ( const char* cfgList )
 {
   /// Setup local directory
+  fNstagedFiles[0] = fNstagedFiles[1] = 0;
+  fStagedBytes[0] = fStagedBytes[1] = 0;
   if ( gSystem->AccessPathName(fWorkDir.c_str()) == 0 ) {
     if ( fRunMode != kLocalTerminate ) {
       std::cout << "Directory " << fWorkDir << " already exists. Overwrite? [y/n]" << std::endl;
@@ -767,6 +2350,7 @@ bool AliTaskSubmitter::SetupLocalWorkDir ( const char* cfgList )
   TObjArray* arr = sCfgList.Tokenize(",");
   TIter nextCfgFile(arr);
   TObject* cfgFilename = 0x0;
+  std::vector<std::string> missingPars;
   std::ofstream outFile(Form("%s/train.cfg",fWorkDir.c_str()));
   while ( (cfgFilename = nextCfgFile()) ) {
     if ( gSystem->AccessPathName(cfgFilename->GetName()) ) {
@@ -789,24 +2373,8 @@ bool AliTaskSubmitter::SetupLocalWorkDir ( const char* cfgList )
         AddObjects(AliAnalysisTaskCfg::DecodeValue(currLine), fileList);
         for ( auto& str : fileList ) {
           if ( str.find(".par") != std::string::npos ) {
-            if ( gSystem->AccessPathName(str.c_str()) ) {
-              // Try to build the par files
-              if ( ! SetAliPhysicsBuildDir() ) {
-                std::cout << "Cannot find par file and cannot build it" << std::endl;
-                return false;
-              }
-              std::string absWorkDir = GetAbsolutePath(fWorkDir.c_str());
-              std::string command = Form("cd %s; make %s; find . -name %s -exec mv -v {} %s/ \\;", fAliPhysicsBuildDir.c_str(), str.c_str(), str.c_str(), absWorkDir.c_str());
-              if ( gSystem->Exec(command.c_str()) == 0 ) {
-                if ( str.find("OADB") != std::string::npos ) {
-                  // Fixes problem with OADB on proof:
-                  // the par file only contians the srcs
-                  // but if you want to access OADB object they must be inside there!
-                  command = Form("cd %s; tar -xzf OADB.par; rsync -avu --exclude=.svn --exclude=PROOF-INF.OADB $ALICE_PHYSICS/OADB/ OADB/; tar -czf OADB.par OADB",fWorkDir.c_str());
-                }
-              }
-              else return false;
-            }
+            // Missing par files are built at the end, all together
+            if ( gSystem->AccessPathName(str.c_str()) && std::find(missingPars.begin(),missingPars.end(),str) == missingPars.end() ) missingPars.push_back(str);
           } // is par file
           else {
             if ( ! CopyFile(str.c_str()) ) return false;
@@ -842,6 +2410,10 @@ bool AliTaskSubmitter::SetupLocalWorkDir ( const char* cfgList )
     .c_str())) ) return false;
   }
 
+  if ( ! missingPars.empty() && ! BuildPars(missingPars) ) return false;
+
+  std::cout << "Staged " << fNstagedFiles[0]+fNstagedFiles[1] << " files in " << fWorkDir << ": copied " << fNstagedFiles[0] << " (" << fStagedBytes[0] << " bytes), reused " << fNstagedFiles[1] << " (" << fStagedBytes[1] << " bytes)" << std::endl;
+
   // AliAnalysisTaskCfg* cfg = nullptr;
   // while ( (cfg = static_cast<AliAnalysisTaskCfg*>(next())) ) {
   //   if ( ! cfg->GetMacro() ) cfg->OpenMacro();
@@ -941,6 +2513,46 @@ bool AliTaskSubmitter::SetAliPhysicsBuildDir ( const char* aliphysicsBuildDir )
   return ( ! fAliPhysicsBuildDir.empty() );
 }
 
+//_______________________________________________________
+void AliTaskSubmitter::SetPrefetch ( int nFiles, const char* cacheDir, double maxCacheGB, int latencyMs, const char* siblingFiles )
+{
+  /// Prefetch the remote input files in local mode:
+  /// the next nFiles files are downloaded in the background in cacheDir,
+  /// whose size is limited to maxCacheGB (the least recently used files are removed).
+  /// latencyMs adds an artificial latency to each download, e.g. to test with file:// inputs.
+  /// The files read by the handlers next to each input (MC kinematics, ESD friends)
+  /// are prefetched with it: siblingFiles is a comma-separated list of other files
+  /// to be prefetched from the directory of each input (e.g. AliAOD.Muons.root for delta AODs)
+  fPrefetchFiles = nFiles;
+  fPrefetchCacheDir = cacheDir;
+  fPrefetchCacheSize = (Long64_t)(maxCacheGB * 1024. * 1024. * 1024.);
+  fPrefetchLatency = latencyMs;
+  fPrefetchSiblings.clear();
+  TObjArray* arr = TString(siblingFiles).Tokenize(",");
+  for ( Int_t iarr=0; iarr<arr->GetEntriesFast(); iarr++ ) {
+    TString sibling = arr->At(iarr)->GetName();
+    sibling.Remove(TString::kBoth,' ');
+    if ( ! sibling.IsNull() ) fPrefetchSiblings.push_back(sibling.Data());
+  }
+  delete arr;
+}
+
+//_______________________________________________________
+void AliTaskSubmitter::SetReducedOADBPar ( bool reduce, const char* extraObjects )
+{
+  /// Only put in the OADB par file the OADB objects referenced in the configuration,
+  /// macros and sources of the train, plus the comma-separated extraObjects
+  /// (relative to $ALICE_PHYSICS/OADB), e.g. those opened by the compiled tasks.
+  /// By default the full OADB is put in the par file
+  fReducedOADBPar = reduce;
+  fOADBExtraObjects.clear();
+  std::stringstream stm(extraObjects);
+  std::string token;
+  while ( std::getline( stm, token, ',' ) ) {
+    if ( ! token.empty() ) fOADBExtraObjects.push_back(token);
+  }
+}
+
 //_______________________________________________________
 bool AliTaskSubmitter::SetInput ( const char* inputName, const char* inputOptions )
 {
@@ -1104,7 +2716,10 @@ bool AliTaskSubmitter::SetupProof ( const char* analysisOptions )
   TString nWorkersStr = anOptions(TRegexp("NWORKERS=[0-9]+"));
   if ( ! nWorkersStr.IsNull() ) {
     nWorkersStr.ReplaceAll("NWORKERS=","");
-    if ( nWorkersStr.IsDigit() ) SetProofNworkers(nWorkersStr.Atoi());
+    if ( nWorkersStr.IsDigit() ) {
+      SetProofNworkers(nWorkersStr.Atoi());
+      SetLocalNworkers(nWorkersStr.Atoi());
+    }
   }
 
   std::string runPodCommand = Form("\"%s/runPod.sh %i\"",fPodOutDir.c_str(), fProofNworkers);
@@ -1220,15 +2835,28 @@ void AliTaskSubmitter::StartAnalysis () const
     return;
   }
 
-  if ( IsGrid() ) mgr->StartAnalysis("grid");
+  if ( fRunMode == kGridTerminate && fStreamMergeJobs > 0 ) {
+    if ( ! MergeGridOutputs() ) return;
+    // Same as kLocalTerminate
+    fPlugin->SetRunMode("full");
+    mgr->StartAnalysis("grid terminate");
+  }
+  else if ( IsGrid() ) mgr->StartAnalysis("grid");
   else if ( terminateOnly ) mgr->StartAnalysis("grid terminate");
   else if ( fRunMode == kLocal ) {
-    std::string treeName = ( fFileType == kAOD ) ? "aodTree" : "esdTree";
-
-    TChain* chain = new TChain(treeName.c_str());
-    for ( auto& str : fInputData ) chain->Add(str.c_str());
+    LearnBranches();
+    TStopwatch sw;
+    TObject* prefetcher = nullptr;
+    TChain* chain = CreateLocalChain(fInputData,prefetcher);
     if (chain) chain->GetListOfFiles()->ls();
     mgr->StartAnalysis("local",chain);
+    if ( prefetcher ) prefetcher->Print();
+    delete prefetcher;
+    PrintReadStats(chain,sw.RealTime(),true);
+  }
+  else if ( fRunMode == kLocalParallel ) {
+    LearnBranches();
+    RunLocalParallel();
   }
   else if ( fRunMode == kProofLite ) mgr->StartAnalysis("proof");
   else {
@@ -1322,19 +2950,75 @@ void AliTaskSubmitter::StartAnalysis () const
 //   outFile.close();
 // }
 
+//_______________________________________________________
+bool AliTaskSubmitter::TasksDeclareBranches () const
+{
+  /// Check that all of the tasks declare the branches they read (AliAnalysisTask::SetBranches).
+  /// If not, the branches cannot be pruned: all branches are read
+  TIter next(AliAnalysisManager::GetAnalysisManager()->GetTasks());
+  AliAnalysisTask* task = nullptr;
+  while ( (task = static_cast<AliAnalysisTask*>(next())) ) {
+    if ( TString(task->GetBranches()).IsNull() ) {
+      std::cout << "Warning: task " << task->GetName() << " does not declare the branches it reads: all branches are read" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
 //_______________________________________________________
 void AliTaskSubmitter::WriteRunScript ( int runMode, const char* inputOptions, const char* analysisOptions, const char* taskOptions, bool isMuonAnalysis ) const
 {
   // Write run script
   std::string outFilename = "runPod.sh";
   std::ofstream outFile(outFilename.c_str());
-  std::string inputName = fIsInputFileCollection ? "dataset.root" : "dataset.txt";
+  // With the SPLIT option, the analysis is run in one directory per run,
+  // on the files of the run listed in the shard plan
+  bool splitPerRun = false;
+  std::vector<InputShard> runShards;
+  if ( fProofSplitPerRun ) {
+    for ( auto& shard : GetShardPlan(1) ) {
+      if ( shard.run.empty() ) std::cout << "Warning: cannot find the run number of " << shard.files.size() << " files: they are not analysed" << std::endl;
+      else {
+        splitPerRun = true;
+        runShards.push_back(shard);
+      }
+    }
+  }
+  if ( splitPerRun && fIsInputFileCollection ) {
+    // The file collection of each run is written in dataset.<run>.root,
+    // keeping the file information of the input collection
+    TFile* file = TFile::Open(fInputData[0].c_str());
+    TFileCollection* fc = file ? static_cast<TFileCollection*>(file->Get("dataset")) : nullptr;
+    std::map<std::string,TFileInfo*> infos;
+    if ( fc ) {
+      TIter next(fc->GetList());
+      TFileInfo* info = nullptr;
+      while ( (info = static_cast<TFileInfo*>(next())) ) infos[info->GetCurrentUrl()->GetUrl()] = info;
+    }
+    for ( auto& shard : runShards ) {
+      TFileCollection runFc("dataset");
+      for ( auto& url : shard.files ) {
+        auto info = infos.find(url);
+        if ( info != infos.end() ) runFc.Add(static_cast<TFileInfo*>(info->second->Clone()));
+      }
+      runFc.Update();
+      TFile* outFile = TFile::Open(Form("dataset.%s.root",shard.run.c_str()),"RECREATE");
+      if ( ! outFile || outFile->IsZombie() ) std::cout << "Error: cannot write the file collection of run " << shard.run << std::endl;
+      else runFc.Write("dataset",TObject::kSingleKey);
+      delete outFile;
+    }
+    delete fc;
+    delete file;
+  }
+  std::string inputName = ( fIsInputFileCollection ) ? "dataset.root" : "dataset.txt";
   outFile << "#!/bin/bash" << std::endl;
   outFile << "nWorkers=${1-80}" << std::endl;
   outFile << "vafctl start" << std::endl;
   outFile << "vafreq $nWorkers" << std::endl;
   outFile << "vafwait $nWorkers" << std::endl;
   outFile << "cd " << fPodOutDir << std::endl;
+  outFile << "status=0" << std::endl;
   // if ( fProofSplitPerRun ) {
   //   outFile << "fileList=$(find . -maxdepth 1 -type f ! -name " << fDatasetName.Data() << " | xargs)" << endl;
   //   outFile << "while read line; do" << endl;
@@ -1360,14 +3044,39 @@ void AliTaskSubmitter::WriteRunScript ( int runMode, const char* inputOptions, c
   // rootCmd.Prepend("root -b -q '");
   // rootCmd.Append("'");
   // outFile << rootCmd.Data() << endl;
+  if ( splitPerRun ) {
+    outFile << "for runNum in $(grep -v '^#' shardPlan.txt | cut -f 2 | grep -v '^-$' | sort -u); do" << std::endl;
+    outFile << "  echo \"Analysing run $runNum\"" << std::endl;
+    outFile << "  mkdir -p $runNum" << std::endl;
+    outFile << "  cd $runNum" << std::endl;
+    outFile << "  rm -f .done" << std::endl;
+    outFile << "  find .. -maxdepth 1 -type f ! -name '*.root' ! -name dataset.txt ! -name shardPlan.txt -exec ln -sf {} \\;" << std::endl;
+    if ( fIsInputFileCollection ) outFile << "  cp -f ../dataset.$runNum.root dataset.root" << std::endl;
+    else outFile << "  grep -v '^#' ../shardPlan.txt | awk -F '\\t' -v run=$runNum '$2 == run { print $4 }' > dataset.txt" << std::endl;
+  }
   outFile << "root -b << EOF" << endl;
   outFile << "gSystem->AddIncludePath(\"-I$ALICE_ROOT/include -I$ALICE_PHYSICS/include\");" << std::endl;
   outFile << ".L AliTaskSubmitter.cxx+" << endl;
   outFile << "AliTaskSubmitter sub;" << std::endl;
   outFile << "sub.SetIsPodMachine(true);" << std::endl;
-  outFile << "sub.Run(" << runMode << ",\"" << inputName << "\",\"" << inputOptions << "\",\"" << analysisOptions << "\",\"" << taskOptions << "\",\"\"," << isMuonAnalysis << ")" << std::endl;
+  // The exit status of root is the one of the analysis
+  outFile << "if ( ! sub.Run(" << runMode << ",\"" << inputName << "\",\"" << inputOptions << "\",\"" << analysisOptions << "\",\"" << taskOptions << "\",\"\"," << isMuonAnalysis << ") ) gSystem->Exit(1);" << std::endl;
   outFile << ".q" << std::endl;
   outFile << "EOF" << std::endl;
+  if ( splitPerRun ) {
+    // The output of the run can be copied back only if the analysis succeeded
+    outFile << "  if [ $? -eq 0 ]; then" << std::endl;
+    outFile << "    touch .done" << std::endl;
+    outFile << "  else" << std::endl;
+    outFile << "    echo \"Error: analysis of run $runNum failed\"" << std::endl;
+    outFile << "    status=1" << std::endl;
+    outFile << "  fi" << std::endl;
+    outFile << "  cd .." << std::endl;
+    outFile << "done" << std::endl;
+    // Merge the outputs of the successful runs, so that the merged output is copied back as well
+    outFile << "for ifile in $(find [0-9]*/ -maxdepth 1 -type f -name '*.root' ! -name dataset.root -exec basename {} \\; | sort -u); do hadd -f $ifile $(for f in [0-9]*/$ifile; do [ -e ${f%/*}/.done ] && echo $f; done); done" << std::endl;
+  }
+  else outFile << "status=$?" << std::endl;
   // if ( fProofSplitPerRun ) {
   //   outFile << "cd $TASKDIR" << endl;
   //   outFile << "done < " << fDatasetName.Data() << endl;
@@ -1384,7 +3093,7 @@ void AliTaskSubmitter::WriteRunScript ( int runMode, const char* inputOptions, c
   // outFile << ".q" << endl;
   // outFile << "EOF" << endl;
   outFile << "vafctl stop" << std::endl;
-  outFile << "exit" << std::endl;
+  outFile << "exit $status" << std::endl;
   outFile.close();
   gSystem->Exec(Form("chmod u+x %s",outFilename.c_str()));
 }
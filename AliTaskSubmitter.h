@@ -9,6 +9,8 @@
 class AliAnalysisAlien;
 class AliAnalysisTaskCfg;
 class TObjString;
+class TStopwatch;
+class TChain;
 
 class AliTaskSubmitter {
 public:
@@ -25,7 +27,8 @@ public:
     kProofLite,
     kProofSaf,
     kProofSaf2,
-    kProofVaf
+    kProofVaf,
+    kLocalParallel
   };
 
   enum {
@@ -64,44 +67,77 @@ public:
   bool SetInput ( const char* inputName, const char* inputOptions );
   void SetIsPodMachine ( bool isPodMachine = true ) { fIsPodMachine = isPodMachine; }
 
+  /// Set number of worker processes in kLocalParallel mode (0 for the number of cores)
+  void SetLocalNworkers ( int nWorkers ) { fLocalNworkers = nWorkers; }
+  /// Prefetch the next nFiles remote input files in a local cache in kLocal and kLocalParallel modes (0 to disable)
+  void SetPrefetch ( int nFiles, const char* cacheDir = "/tmp/inputPrefetchCache", double maxCacheGB = 20., int latencyMs = 0, const char* siblingFiles = "" );
   /// Set number of workers for proof
   void SetProofNworkers ( int nWorkers ) { fProofNworkers = nWorkers; }
   /// Analyse run by run on proof
   void SetProofSplitPerRun ( bool splitPerRun ) { fProofSplitPerRun = splitPerRun; }
+  /// Only put the referenced OADB objects, plus extraObjects, in the OADB par file (the full OADB is used by default)
+  void SetReducedOADBPar ( bool reduce = true, const char* extraObjects = "COMMON/PHYSICSSELECTION,COMMON/CENTRALITY,COMMON/MULTIPLICITY,COMMON/PID" );
   /// Resume proof session (when analysis needs to be run several times, using the previous steps)
   void SetResumeProofSession ( bool resumeProof = true ) { fProofResume = resumeProof; }
 
   // /// Enable event mixing
   // void SetMixingEvent ( bool mixingEvent ) { fEventMixing = mixingEvent; }
   void SetSoftVersion ( const char* softVersion = "" );
+  /// Set the directory where the files staged in the working directory are cached by content (empty to disable)
+  void SetStagingCacheDir ( const char* stagingCacheDir ) { fStagingCacheDir = stagingCacheDir; }
+  /// Merge the outputs of the runs while they are downloaded in kGridTerminate and PoD with SPLIT, with nConcurrent downloads (0 to disable)
+  void SetStreamingMerge ( int nConcurrent, int pollSeconds = 30 ) { fStreamMergeJobs = nConcurrent; fStreamMergePoll = pollSeconds; }
 
   bool SetupAndRun ( const char* workDir, const char* cfgList, int runMode, const char* inputName, const char* inputOptions = "", const char* analysisOptions = "", const char* taskOptions = "" );
 
 private:
 
+  /// Input files processed together
+  struct InputShard {
+    std::string run; ///< Run number (when splitting per run)
+    Long64_t size = 0; ///< Total size
+    std::vector<std::string> files; ///< Input files
+  };
+
   void AddObjects ( const char* objname, std::vector<std::string>& objlist );
+  void AddStartupPhase ( std::vector<std::pair<std::string,double>>& phases, const char* name, TStopwatch& sw ) const;
   bool AddTask ( const char* configFilename );
+  bool ApplyBranchSet () const;
+  bool BuildOADBPar ( const char* sourcePar, const char* outPar ) const;
+  bool BuildPars ( const std::vector<std::string>& pars );
   bool CopyFile ( const char* inFilename, const char* outFilename = nullptr ) const;
 
   void CreateAlienHandler();
+  TChain* CreateLocalChain ( const std::vector<std::string>& files, TObject*& prefetcher ) const;
   std::string GetAbsolutePath ( const char* path ) const;
+  std::vector<std::string> GetOADBObjects () const;
+  std::string GetOADBObjectsKey () const;
+  std::string GetParBuildKey () const;
+  std::vector<InputShard> GetShardPlan ( int nShards ) const;
   std::string GetGridQueryVal ( const char* queryString, const char* keyword ) const;
   std::string GetGridDataDir ( const char* queryString ) const;
   std::string GetGridDataPattern ( const char* queryString ) const;
   std::string GetRunNumber ( const char* checkString ) const;
   bool IsGrid() const { return (fRunMode == kGrid || fRunMode == kGridTest || fRunMode == kGridMerge || fRunMode == kGridTerminate ); }
   bool IsPod() const { return ( ! fProofCopyCommand.empty() ); }
+  bool LearnBranches () const;
   bool Load() const;
+  bool LoadCompiledSources() const;
   bool LoadProof() const;
+  bool MergeGridOutputs () const;
+  void PrintReadStats ( TChain* chain, double realTime, bool record ) const;
   int ReplaceKeywords ( std::string& input ) const;
   int ReplaceKeywords ( TObjString* input ) const;
+  bool RunLocalParallel() const;
   bool RunPod() const;
   void SetKeywords ();
+  void SetupBranchSet ( const char* analysisOptions, bool isMuonAnalysis );
   void SetupHandlers ( const char* analysisOptions, bool isMuonAnalysis );
   bool SetupLocalWorkDir ( const char* cfgList );
   bool SetupProof ( const char* analysisOptions );
   bool SetupTasks ();
   void StartAnalysis() const;
+  bool TasksDeclareBranches () const;
   // void WriteAnalysisMacro() const;
   // void WriteLoadLibs() const;
   void WriteRunScript ( int runMode, const char* inputOptions, const char* analysisOptions, const char* taskOptions, bool isMuonAnalysis ) const;
@@ -114,18 +150,27 @@ private:
   bool fIsPodMachine; //!<! We are on pod machine
   bool fProofResume; //!<! Resume proof session
   bool fProofSplitPerRun; //!<! Split analysis per run
+  bool fReducedOADBPar; //!<! Only put the referenced OADB objects in the OADB par file
   int fFileType; //!<! File type
   int fProofNworkers; //!<! Proof N workers
+  int fLocalNworkers; //!<! N worker processes in kLocalParallel mode
+  int fBranchLearnEntries; //!<! Entries used to learn the branches read by the train (0 to read all)
+  int fPrefetchFiles; //!<! Number of input files prefetched in local mode
+  int fPrefetchLatency; //!<! Artificial latency of the prefetch (ms)
+  int fStreamMergeJobs; //!<! Concurrent downloads of the streaming merge (0 to disable)
+  int fStreamMergePoll; //!<! Interval between two checks of the outputs in the streaming merge (s)
   int fRunMode; //!<! Analysis mode
   int fGridTestFiles; //!<! Number of test files for grid
   std::string fAlienUsername; //!<! Alien username
   std::string fAliPhysicsBuildDir; //!<! Aliphysics build dir
+  std::string fBranchSetFile; //!<! Branches read by the train (keyed on the tasks of the train)
   std::string fGridDataDir; //!<! Data dir for grid analysis
   std::string fGridDataPattern; //!<! Data pattern for grid analysis
   std::string fGridWorkingDir; //!<! Grid working directory
   std::string fPass; //!<! Pass name
   std::string fPeriod; //!<! Period name
   std::string fPodOutDir; //!<! Pod out dir
+  std::string fPrefetchCacheDir; //!<! Prefetch cache directory
   std::string fProofCluster; //!<! Proof cluster
   std::string fProofDatasetMode; //!<! Proof dataset mode
   std::string fProofServer; //!<! Proof server
@@ -133,6 +178,7 @@ private:
   std::string fProofOpenCommand; //!<! Proof open command
   std::string fProofExecCommand; //!<! Proof exec command
   std::string fSoftVersion; //!<! Software version for analysis
+  std::string fStagingCacheDir; //!<! Content-addressed cache of the staged files
   std::string fSubmitterDir; //!<! Submitter director
   std::string fTaskOptions; //!<! Task options
   std::string fWorkDir;     //!<! Local working directory
@@ -140,13 +186,20 @@ private:
   std::vector<std::string> fInputData; //!<! Input data list
   std::vector<std::string> fLibraries; //!<! Libraries
   std::vector<std::string> fMacros; //!<! Macros
+  std::vector<std::string> fOADBExtraObjects; //!<! OADB objects always put in the reduced OADB par file
   std::vector<std::string> fPackages; //!<! List of PAR files
+  std::vector<std::string> fPrefetchSiblings; //!<! Files prefetched from the directory of each input (friends, delta AODs)
   std::vector<std::string> fSources; //!<! Analysis sources (cxx)
   mutable std::vector<AliAnalysisTaskCfg> fTasks; //!<! Analysis tasks
   std::map<std::string,std::string> fKeywords; //!<! List of keywords
   std::map<std::string,int> fUtilityMacros; //!<! Utility macros
   TMap fMap; //!<! Map of values to be passed to macros (for backward compatibility)
   AliAnalysisAlien* fPlugin; //!<! Analysis plugin
+  mutable int fNstagedFiles[2]; //!<! Number of files staged in the working dir (copied, reused)
+  mutable Long64_t fStagedBytes[2]; //!<! Bytes staged in the working dir (copied, reused)
+  Long64_t fPrefetchCacheSize; //!<! Maximum size of the prefetch cache
+  Long64_t fTreeCacheSize; //!<! TTreeCache size (0 for automatic)
+  mutable int fTreeCacheLearnEntries; //!<! TTreeCache learn entries before ApplyBranchSet (-1 if unchanged)
 
   // ClassDef(AliTaskSubmitter, 1); // Task submitter
 };
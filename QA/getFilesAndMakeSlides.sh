@@ -3,15 +3,25 @@
 baseRemoteDir="http://aliqamu.web.cern.ch/aliqamu"
 baseRemoteDirEVS="http://aliqaevs.web.cern.ch/aliqaevs"
 triggerList=""
+fetchOnly=0
+batchManifest=""
+nSlideWorkers=4
+maxParallel=8
+fetchManifest="$PWD/.qaFetchManifest"
 authors='Cynthia Hadjidakis, Diego Stocco, Chun-Lu Huang'
 
-optList="a:cst:"
+optList="a:b:cfj:n:r:st:"
 while getopts $optList option
 do
   case $option in
     a ) authors=$OPTARG;;
     c ) baseRemoteDir="aliqamu@lxplus.cern.ch:/afs/cern.ch/work/a/aliqamu/www";;
-#    f ) forceLatex=1;;
+    b ) batchManifest=$OPTARG;;
+    f ) fetchOnly=1;;
+    j ) maxParallel=$OPTARG;;
+    n ) nSlideWorkers=$OPTARG;;
+    r ) baseRemoteDir=$OPTARG
+        baseRemoteDirEVS=$OPTARG;;
     s ) baseRemoteDir="${SUBA}:/scratch/aliced/stocco/gridAnalysis/muonQA/MU";;
     t ) triggerList=$OPTARG;;
     * ) echo "Unimplemented option chosen."
@@ -23,10 +33,14 @@ done
 shift $(($OPTIND - 1))
 
 if [[ "$EXIT" -eq 1 ]]; then
-  echo "Usage: `basename $0` (-$optList) dataType/year/period/pass"
+  echo "Usage: `basename $0` (-$optList) dataType/year/period/pass [dataType/year/period/pass ...]"
   echo "       -a comma separated author list (default: $authors)"
+  echo "       -b make the slides of all periods in the manifest, without prompts (one line per period: dataType/year/period/pass triggerList)"
   echo "       -c search on cern afs (default: $baseRemoteDir)"
-#  echo "       -f run latex even for existing files (default: $forceLatex)"
+  echo "       -f only download the QA files of all the listed periods (no slides)"
+  echo "       -j number of parallel downloads (default: $maxParallel)"
+  echo "       -n number of periods processed in parallel with -b (default: $nSlideWorkers)"
+  echo "       -r base url of the QA files (e.g. a local server for tests)"
   echo "       -s search on subatech (default: $baseRemoteDir)"
   echo "       -t comma separated trigger list"
   exit 2
@@ -90,49 +104,171 @@ function SetupDir()
 }
 
 
+function ManifestGet()
+{
+  # Get the ETag of the file recorded in the manifest
+  local outFile="$1"
+  if [ -e "$fetchManifest" ]; then
+    awk -F '\t' -v file="$outFile" '$1 == file { etag=$2 } END { print etag }' "$fetchManifest"
+  fi
+}
+
+
+function GetHeaderETag()
+{
+  local headerFile="$1"
+  if [ -e "$headerFile" ]; then
+    grep -i '^etag:' "$headerFile" | tail -n 1 | cut -d ' ' -f 2- | tr -d '\r'
+  fi
+}
+
+
 function GetRemoteFile()
 {
+  # Download a single file and write the outcome in resultFile:
+  # local file, ETag, mtime, status (downloaded, resumed, notModified, synced, failed)
   local inFile=$1
   local outFile=$2
+  local resultFile=$3
 
+  local status="failed"
+  local etag=""
   if [ ${inFile:0:4} = "http" ]; then
-    if [ -e $outFile ]; then
-      # Download only if local file is older than remote file
-      curl -f -z "$outFile" -R -o "$outFile" "$inFile"
-    else
-      curl -f -R -o "$outFile" "$inFile"
+    # The file is downloaded in a .part file, which is kept if the transfer is interrupted.
+    # Its headers are kept as well, so that the transfer is resumed only if the remote file did not change
+    local partFile="$outFile.part"
+    local headerFile="$partFile.headers"
+    local attempt httpCode exitCode
+    for attempt in 1 2; do
+      local opts=(-s -f -R -D "$headerFile.new" -o "$partFile" -w "%{http_code}")
+      if [ -s "$partFile" ]; then
+        opts+=(-C -)
+        local partETag
+        partETag=$(GetHeaderETag "$headerFile")
+        if [ -n "$partETag" ]; then
+          opts+=(-H "If-Range: $partETag")
+        fi
+      elif [ -e "$outFile" ]; then
+        # Download only if local file is older than remote file, or if the ETag changed
+        opts+=(-z "$outFile")
+        etag=$(ManifestGet "$outFile")
+        if [ -n "$etag" ]; then
+          opts+=(-H "If-None-Match: $etag")
+        fi
+      fi
+      httpCode=$(curl "${opts[@]}" "$inFile")
+      exitCode=$?
+      if [ $exitCode -eq 33 ]; then
+        # The server cannot resume: restart from scratch
+        rm -f "$partFile" "$headerFile"
+        continue
+      fi
+      break
+    done
+    if [ -e "$headerFile.new" ]; then
+      if [ "$httpCode" = "200" ]; then
+        mv "$headerFile.new" "$headerFile"
+      elif [ "$httpCode" = "206" ]; then
+        cat "$headerFile.new" >> "$headerFile"
+        rm "$headerFile.new"
+      else
+        rm "$headerFile.new"
+      fi
+    fi
+    if [[ $exitCode -eq 0 && "$httpCode" = "304" ]]; then
+      status="notModified"
+      rm -f "$partFile" "$headerFile"
+    elif [[ $exitCode -eq 0 && ( "$httpCode" = "200" || "$httpCode" = "206" ) ]]; then
+      [ "$httpCode" = "206" ] && status="resumed" || status="downloaded"
+      etag=$(GetHeaderETag "$headerFile")
+      mv "$partFile" "$outFile"
+      rm -f "$headerFile"
+    elif [ ! -s "$partFile" ]; then
+      rm -f "$partFile" "$headerFile"
     fi
   else
-    rsync -avu "$inFile" "$outFile"
+    rsync -au --partial "$inFile" "$outFile" > /dev/null 2>&1 && status="synced"
   fi
 
-  if [ ! -e $outFile ]; then
+  if [[ "$status" = "failed" || ! -e "$outFile" ]]; then
+    status="failed"
     echo "Problems in downloading file $inFile"
-    return 1
   fi
-
-  return 0
+  local mtime=""
+  if [ -e "$outFile" ]; then
+    mtime=$(date -r "$outFile" +%s)
+  fi
+  printf "%s\t%s\t%s\t%s\n" "$outFile" "$etag" "$mtime" "$status" > "$resultFile"
+  [ "$status" != "failed" ]
 }
 
 
-function GetRemoteQAFiles()
+function GetRemoteFiles()
 {
-  #### Syncronize with remote directory
+  # Download the files (arguments: remote1 local1 remote2 local2 ...)
+  # with maxParallel downloads at the same time.
+  # The ETag and mtime of the local files are recorded in the manifest,
+  # so that the files are downloaded again only if they changed
+  local resultDir
+  resultDir=$(mktemp -d)
+  local ifile=0
+  # The loop runs in a subshell: its counter is not used afterwards
+  while [ $# -ge 2 ]; do
+    MakeDir "$(dirname "$2")"
+    printf "%s\0%s\0%s\0" "$1" "$2" "$resultDir/$ifile"
+    ifile=$((ifile+1))
+    shift 2
+  done | xargs -0 -n 3 -P "$maxParallel" bash -c "$(declare -f ManifestGet GetHeaderETag GetRemoteFile); fetchManifest=\"$fetchManifest\"; GetRemoteFile \"\$@\"" _
+
+  # Update the manifest
+  cat "$resultDir"/* > "$resultDir/results" 2> /dev/null
+  if [ -e "$fetchManifest" ]; then
+    awk -F '\t' 'NR == FNR { updated[$1]=1; next } ! ( $1 in updated )' "$resultDir/results" "$fetchManifest" > "$resultDir/manifest"
+  fi
+  awk -F '\t' -v OFS='\t' '$4 != "failed" { print $1, $2, $3 }' "$resultDir/results" >> "$resultDir/manifest"
+  mv "$resultDir/manifest" "$fetchManifest"
+
+  echo "Fetched $(wc -l < "$resultDir/results" | xargs) files:"
+  cut -f 4 "$resultDir/results" | sort | uniq -c
+  rm -rf "$resultDir"
+}
+
 
+function GetRemoteQAFilesList()
+{
+  # Remote and local QA files of a period
   local baseRemote="$1"
   local relPath="$2"
 
   local inputDir="${baseRemote}/$relPath"
-  GetRemoteFile "$inputDir/QA_muon_tracker.root" "$relPath/QA_muon_tracker.root"
-  GetRemoteFile "$inputDir/QA_muon_trigger.root" "$relPath/QA_muon_trigger.root"
+  echo "$inputDir/QA_muon_tracker.root" "$relPath/QA_muon_tracker.root"
+  echo "$inputDir/QA_muon_trigger.root" "$relPath/QA_muon_trigger.root"
+  echo "${baseRemoteDirEVS}/$relPath/trending.root" "$relPath/trending_evs.root"
+}
 
-  if [ $? -eq 1 ]; then
-    return 1
-  fi
 
-  GetRemoteFile "${baseRemoteDirEVS}/$relPath/trending.root" "$relPath/trending_evs.root"
+function GetRemoteQAFiles()
+{
+  #### Syncronize with remote directory
 
-  return 0
+  local baseRemote="$1"
+  shift
+  local relPath
+  local fileList=()
+  for relPath in "$@"; do
+    fileList+=($(GetRemoteQAFilesList "$baseRemote" "$relPath"))
+  done
+  GetRemoteFiles "${fileList[@]}"
+
+  local isOk=0
+  for relPath in "$@"; do
+    if [[ ! -e "$relPath/QA_muon_tracker.root" || ! -e "$relPath/QA_muon_trigger.root" ]]; then
+      echo "Missing QA files in $relPath"
+      isOk=1
+    fi
+  done
+
+  return $isOk
 }
 
 
@@ -374,6 +510,34 @@ function PrintRunSummary()
   echo "${onlyInLogbook}" | xargs
 }
 
+function MakeBatchQASlides()
+{
+  ##### Make the slides of all periods of the manifest, without prompts
+  local manifest="$1"
+  if [ -z $ALICE_PHYSICS ]; then
+    echo "Please set ALICE_PHYSICS environement"
+    return 1
+  fi
+  if [ ! -e "$manifest" ]; then
+    echo "Cannot find $manifest"
+    return 1
+  fi
+  local relPaths=()
+  local relPath
+  for relPath in $(grep -v '^#' "$manifest" | awk '{print $1}'); do
+    relPaths+=("${relPath#\/}")
+  done
+  # The periods with missing QA files are reported by makeQASlides.C
+  GetRemoteQAFiles "$baseRemoteDir" "${relPaths[@]}"
+
+  local scriptDir
+  scriptDir=$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)
+  root -b << EOF
+.L $scriptDir/makeQASlides.C+
+makeQASlides("$manifest","$authors",$nSlideWorkers,"$texFile")
+EOF
+}
+
 function CompileLatex()
 {
   local compileTexLog="pdflatex.log"
@@ -388,6 +552,18 @@ function CompileLatex()
 
 function main() {
   local baseLocalDir="$PWD"
+  if [ -n "$batchManifest" ]; then
+    MakeBatchQASlides "$batchManifest"
+    return $?
+  fi
+  if [[ $fetchOnly -eq 1 ]]; then
+    local relPaths=()
+    for subDir in "$@"; do
+      relPaths+=("${subDir#\/}")
+    done
+    GetRemoteQAFiles "$baseRemoteDir" "${relPaths[@]}"
+    return $?
+  fi
   SetupDir
 
   local localDir="$baseLocalDir/$subDir"
@@ -420,4 +596,4 @@ function main() {
   return 0
 }
 
-main
+main "$@"
@@ -0,0 +1,124 @@
+#ifndef QAWORKERPOOL_H
+#define QAWORKERPOOL_H
+
+#if !defined(__CINT__) || defined(__MAKECINT__)
+#include <Riostream.h>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <functional>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// ROOT includes
+#include "TString.h"
+#include "TSystem.h"
+#endif
+
+// Job processed by a worker of the pool.
+// The derived jobs provide:
+// TString GetJobName() const: unique name, usable as a file name
+// void WriteFields(std::ostream&) const and Bool_t ReadFields(std::istream&):
+//   the fields which are filled by the worker, besides the status
+// TString GetReportLine() const: line of the status report
+struct QAJob {
+  QAJob() : status("notProcessed"), elapsed(0.), worker(-1) {}
+  TString status; ///< Status of the job (notProcessed if no worker took it)
+  Double_t elapsed; ///< Time spent on the job (s)
+  Int_t worker; ///< Worker which processed the job
+};
+
+//_______________________________________________________
+template<class Job>
+Int_t RunQAWorkerPool(std::vector<Job>& jobs, Int_t nWorkers, TString statusDir, std::function<void(Job&)> processJob, std::function<void()> initWorker = nullptr)
+{
+  //
+  // Process the jobs with nWorkers forked processes.
+  // The jobs are distributed through a pipe: each worker takes the next job when it is free,
+  // and writes the status of the job in statusDir/jobName.status, which is read back
+  // by the parent once all of the workers are done.
+  // initWorker is called once in each worker (e.g. to open its own grid connection).
+  // Returns the number of workers started
+  //
+  if ( nWorkers < 1 ) nWorkers = 1;
+  nWorkers = std::min(nWorkers, (Int_t)jobs.size());
+
+  Int_t fds[2];
+  if ( pipe(fds) != 0 ) {
+    printf("Error: cannot create the pipe to the workers\n");
+    return 0;
+  }
+  gSystem->mkdir(statusDir.Data(), kTRUE);
+  for ( auto& job : jobs ) gSystem->Unlink(Form("%s/%s.status", statusDir.Data(), job.GetJobName().Data()));
+  std::vector<pid_t> pids;
+  for ( Int_t iworker=0; iworker<nWorkers; iworker++ ) {
+    pid_t pid = fork();
+    if ( pid < 0 ) {
+      printf("Error: cannot start worker %i\n", iworker);
+      continue;
+    }
+    if ( pid == 0 ) {
+      close(fds[1]);
+      if ( initWorker ) initWorker();
+      Int_t ijob = -1;
+      while ( read(fds[0], &ijob, sizeof(ijob)) == sizeof(ijob) ) {
+        Job& job = jobs[ijob];
+        job.worker = iworker;
+        processJob(job);
+        std::ofstream outFile(Form("%s/%s.status", statusDir.Data(), job.GetJobName().Data()));
+        outFile << job.status.Data() << " " << job.elapsed << " " << job.worker << " ";
+        job.WriteFields(outFile);
+        outFile << std::endl;
+      }
+      close(fds[0]);
+      // Do not run the destructors of the objects copied from the parent
+      _exit(0);
+    }
+    pids.push_back(pid);
+  }
+  close(fds[0]);
+  if ( ! pids.empty() ) {
+    for ( Int_t ijob=0; ijob<(Int_t)jobs.size(); ijob++ ) {
+      if ( write(fds[1], &ijob, sizeof(ijob)) != sizeof(ijob) ) break;
+    }
+  }
+  close(fds[1]);
+  for ( auto pid : pids ) waitpid(pid, 0x0, 0);
+
+  // Collect the status of the jobs
+  for ( auto& job : jobs ) {
+    std::ifstream inFile(Form("%s/%s.status", statusDir.Data(), job.GetJobName().Data()));
+    std::string status;
+    if ( inFile >> status >> job.elapsed >> job.worker && job.ReadFields(inFile) ) job.status = status.c_str();
+  }
+  return (Int_t)pids.size();
+}
+
+//_______________________________________________________
+template<class Job>
+void WriteQAStatus(const std::vector<Job>& jobs, TString statusFile, TString columns, Double_t elapsed, Int_t nWorkers, TString summary)
+{
+  //
+  // Write the status report: one line per job (tab separated),
+  // with a header giving the column names and the total time,
+  // and print the summary followed by the number of jobs per status
+  //
+  std::ofstream outFile(statusFile.Data());
+  outFile << "# workers " << nWorkers << " elapsed " << elapsed << std::endl;
+  outFile << "# " << columns.Data() << std::endl;
+  std::map<TString,Int_t> nStatus;
+  Double_t sumElapsed = 0.;
+  for ( auto& job : jobs ) {
+    outFile << job.GetReportLine().Data() << std::endl;
+    nStatus[job.status]++;
+    sumElapsed += job.elapsed;
+  }
+  outFile.close();
+
+  printf("\n%s with %i workers in %g s (%g s of work):", summary.Data(), nWorkers, elapsed, sumElapsed);
+  for ( auto& entry : nStatus ) printf(" %s %i", entry.first.Data(), entry.second);
+  printf("\nStatus written in %s\n", statusFile.Data());
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef GRIDFILETIME_H
+#define GRIDFILETIME_H
+
+#if !defined(__CINT__) || defined(__MAKECINT__)
+#include <cstdio>
+#include <cstdlib>
+
+// ROOT includes
+#include "TString.h"
+#include "TMap.h"
+#include "TObjString.h"
+#include "TDatime.h"
+#endif
+
+//_______________________________________________________
+inline Long_t GetGridFileTime(TMap* map)
+{
+  //
+  // Get the creation time of a file from its entry in the result of a grid command.
+  // The ctime is either a date (YYYY-MM-DD hh:mm:ss) or the number of seconds
+  // (or milliseconds) since the epoch.
+  // Returns -1 if the ctime is missing or cannot be parsed
+  //
+  TObjString* objs = dynamic_cast<TObjString*>(map->GetValue("ctime"));
+  if ( ! objs ) return -1;
+  TString ctime = objs->GetString();
+  ctime.Remove(TString::kBoth, ' ');
+  if ( ctime.IsNull() ) return -1;
+  if ( ctime.IsDigit() ) {
+    Long64_t epoch = ctime.Atoll();
+    if ( epoch > 100000000000LL ) epoch /= 1000;
+    return ( epoch > 0 ) ? (Long_t)epoch : -1;
+  }
+  Int_t year, month, day, hour, minute, second;
+  if ( sscanf(ctime.Data(), "%4d-%2d-%2d %2d:%2d:%2d", &year, &month, &day, &hour, &minute, &second) != 6 || year < 1995 ) return -1;
+  return TDatime(year, month, day, hour, minute, second).Convert();
+}
+
+#endif
@@ -40,6 +40,14 @@ if [ $2 ]; then
   userMail="$2"
 fi
 
+# With "monitor", a resident monitor (gridMonitor) is started instead of a single check.
+# If the monitor is already running, nothing is done: the script can still be run by crontab
+# to restart the monitor in case it dies
+runMode="check"
+if [ $3 ]; then
+  runMode="$3"
+fi
+
 isValidToken=`alien-token-info | grep -c "Token is still valid"`
 if [ $isValidToken -eq 0 ]; then
     echo "No valid token found. Nothing done!"
@@ -58,11 +66,34 @@ fi
 
 echo "Valid token $isValidToken proxy $proxyValidity" >> $outFilename 2>&1
 
+if [ "$runMode" == "monitor" ]; then
+  pidFile="/tmp/gridMonitor.pid"
+  if [ -e $pidFile ] && kill -0 $(cat $pidFile) 2> /dev/null; then
+    echo "Monitor already running with PID $(cat $pidFile)" >> $outFilename 2>&1
+    exit
+  fi
+  monitorFilename="/tmp/outGridMonitor.txt"
+  echo "Monitor started with PID $$: output in $monitorFilename" >> $outFilename 2>&1
+  echo $$ > $pidFile
+  date >> $monitorFilename 2>&1
+  exec root -b <<EOF >> $monitorFilename 2>&1
+TStopwatch loadTimer;
+.L $pathToMacro/gridCommands.C+
+printf("Macro loading: %g s\\n", loadTimer.RealTime());
+gridMonitor(${minRunNum},"ALL",-1,"${userMail}");
+.q
+EOF
+fi
+
 root -b <<EOF >> $outFilename 2>&1
+TStopwatch loadTimer;
 .L $pathToMacro/gridCommands.C+
+printf("Macro loading: %g s\\n", loadTimer.RealTime());
 gridFindFailed(${minRunNum},"ALL",-1,"${userMail}");
 .q
 EOF
 
 # Crontab example:
-# 55 * 22-23 12 * /users/aliced/stocco/macros/gridAnalysis/runCheckGridJobs.sh 249044215 > /dev/null 2>&1
\ No newline at end of file
+# 55 * 22-23 12 * /users/aliced/stocco/macros/gridAnalysis/runCheckGridJobs.sh 249044215 > /dev/null 2>&1
+# Crontab example with the resident monitor (restarted only if it is not running):
+# */10 * * * * /users/aliced/stocco/macros/gridAnalysis/runCheckGridJobs.sh 249044215 user@cern.ch monitor > /dev/null 2>&1
\ No newline at end of file
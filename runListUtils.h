@@ -0,0 +1,198 @@
+#ifndef RUNLISTUTILS_H
+#define RUNLISTUTILS_H
+
+//--------------------------------------------------------------------------
+// Run list reading and set operations (used by runListUtils.C and aafUtils/datasetUtilities.C).
+// The run lists are sorted vectors of unique run numbers,
+// so that the set operations are linear in the number of runs.
+//
+// The run numbers are read from any text (run lists, dataset search strings,
+// logbook exports, latex tables...): a run number is a sequence of 6 or 9 digits
+// (as in the grid paths, e.g. 000244918).
+//--------------------------------------------------------------------------
+
+#if !defined(__CINT__) || defined(__MAKECINT__)
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+
+// ROOT includes
+#include "TString.h"
+#include "TSystem.h"
+#include "TObjArray.h"
+#include "TObjString.h"
+#endif
+
+/// Sorted list of unique run numbers
+typedef std::vector<Int_t> RunList;
+
+//______________________________________________________________________________
+inline Bool_t RunListHasToken ( const char* line, size_t length, const std::string& token )
+{
+  /// Check if the line contains the token as a whole word (e.g. a path component)
+  auto isWordChar = [](char ch) { return isalnum((unsigned char)ch) || ch == '_' || ch == '-'; };
+  const char* lineEnd = line + length;
+  const char* match = line;
+  while ( ( match = std::search(match,lineEnd,token.begin(),token.end()) ) != lineEnd ) {
+    const char* matchEnd = match + token.size();
+    if ( ( match == line || ! isWordChar(match[-1]) ) && ( matchEnd == lineEnd || ! isWordChar(*matchEnd) ) ) return kTRUE;
+    match = matchEnd;
+  }
+  return kFALSE;
+}
+
+//______________________________________________________________________________
+inline void RunListParse ( const char* text, size_t length, RunList& runs, Bool_t firstPerLine = kFALSE, const std::vector<std::string>& filters = std::vector<std::string>() )
+{
+  /// Add the run numbers found in the text to runs (which is sorted at the end).
+  /// With firstPerLine, only the first run number of each line is taken.
+  /// The lines which do not contain all the filters (e.g. period and pass) are skipped
+  const char* end = text + length;
+  const char* lineStart = text;
+  while ( lineStart < end ) {
+    const char* lineEnd = static_cast<const char*>(memchr(lineStart,'\n',end-lineStart));
+    if ( ! lineEnd ) lineEnd = end;
+    Bool_t isSelected = kTRUE;
+    for ( auto& filter : filters ) {
+      if ( ! RunListHasToken(lineStart,lineEnd-lineStart,filter) ) {
+        isSelected = kFALSE;
+        break;
+      }
+    }
+    const char* ch = lineStart;
+    while ( isSelected && ch < lineEnd ) {
+      if ( ! isdigit((unsigned char)*ch) ) {
+        ++ch;
+        continue;
+      }
+      const char* digitStart = ch;
+      Int_t value = 0;
+      while ( ch < lineEnd && isdigit((unsigned char)*ch) ) {
+        if ( ch - digitStart < 9 ) value = 10 * value + ( *ch - '0' );
+        ++ch;
+      }
+      Long_t nDigits = ch - digitStart;
+      if ( nDigits == 6 || nDigits == 9 ) {
+        runs.push_back(value);
+        if ( firstPerLine ) break;
+      }
+    }
+    lineStart = lineEnd + 1;
+  }
+  std::sort(runs.begin(),runs.end());
+  runs.erase(std::unique(runs.begin(),runs.end()),runs.end());
+}
+
+//______________________________________________________________________________
+inline RunList RunListRead ( TString input, Bool_t firstPerLine = kFALSE, TString period = "", TString pass = "" )
+{
+  /// Read the run numbers from a file.
+  /// If the file does not exist, input is interpreted as a list of runs (e.g. comma separated)
+  std::vector<std::string> filters;
+  if ( ! period.IsNull() ) filters.push_back(period.Data());
+  if ( ! pass.IsNull() ) filters.push_back(pass.Data());
+  RunList runs;
+  TString filename = input;
+  gSystem->ExpandPathName(filename);
+  if ( gSystem->AccessPathName(filename.Data()) ) {
+    RunListParse(input.Data(),input.Length(),runs,kFALSE,filters);
+    return runs;
+  }
+  std::ifstream inFile(filename.Data(),std::ios::binary);
+  std::string content((std::istreambuf_iterator<char>(inFile)),std::istreambuf_iterator<char>());
+  RunListParse(content.data(),content.size(),runs,firstPerLine,filters);
+  return runs;
+}
+
+//______________________________________________________________________________
+inline RunList RunListUnion ( const RunList& runs1, const RunList& runs2 )
+{
+  /// Runs in runs1 or in runs2
+  RunList runs;
+  runs.reserve(runs1.size()+runs2.size());
+  std::set_union(runs1.begin(),runs1.end(),runs2.begin(),runs2.end(),std::back_inserter(runs));
+  return runs;
+}
+
+//______________________________________________________________________________
+inline RunList RunListIntersection ( const RunList& runs1, const RunList& runs2 )
+{
+  /// Runs both in runs1 and in runs2
+  RunList runs;
+  std::set_intersection(runs1.begin(),runs1.end(),runs2.begin(),runs2.end(),std::back_inserter(runs));
+  return runs;
+}
+
+//______________________________________________________________________________
+inline RunList RunListDifference ( const RunList& runs1, const RunList& runs2 )
+{
+  /// Runs in runs1 but not in runs2
+  RunList runs;
+  std::set_difference(runs1.begin(),runs1.end(),runs2.begin(),runs2.end(),std::back_inserter(runs));
+  return runs;
+}
+
+//______________________________________________________________________________
+inline std::string RunListToString ( const RunList& runs, const char* separator = " " )
+{
+  /// Runs separated by separator
+  std::stringstream ss;
+  for ( size_t irun=0; irun<runs.size(); ++irun ) {
+    if ( irun > 0 ) ss << separator;
+    ss << runs[irun];
+  }
+  return ss.str();
+}
+
+//______________________________________________________________________________
+inline void RunListWrite ( const RunList& runs, TString output, TString searchString = "" )
+{
+  /// Write the runs, one per line, in output (or on screen if output is empty).
+  /// If searchString is specified (e.g. "/alice/data/2015/LHC15o/%09i/pass1/AOD"),
+  /// the run number is formatted with it (dataset search string)
+  FILE* outFile = output.IsNull() ? stdout : fopen(output.Data(),"w");
+  if ( ! outFile ) {
+    printf("Error: cannot write %s\n",output.Data());
+    return;
+  }
+  const char* format = searchString.IsNull() ? "%i" : searchString.Data();
+  for ( auto run : runs ) {
+    fprintf(outFile,format,run);
+    fputc('\n',outFile);
+  }
+  if ( outFile != stdout ) fclose(outFile);
+}
+
+//______________________________________________________________________________
+inline void RunListPrintComparison ( const RunList& runs1, const RunList& runs2, TString name1, TString name2 )
+{
+  /// Print the common runs and the runs found in only one list
+  RunList common = RunListIntersection(runs1,runs2);
+  RunList onlyIn1 = RunListDifference(runs1,runs2);
+  RunList onlyIn2 = RunListDifference(runs2,runs1);
+  printf("Common runs (%zu) :\n%s\n\n",common.size(),RunListToString(common).c_str());
+  printf("only in %s (%zu) :\n%s\n\n",name1.Data(),onlyIn1.size(),RunListToString(onlyIn1).c_str());
+  printf("only in %s (%zu) :\n%s\n",name2.Data(),onlyIn2.size(),RunListToString(onlyIn2).c_str());
+}
+
+//______________________________________________________________________________
+inline TString RunListGetOption ( TString options, TString key )
+{
+  /// Get the value of key=value in the space separated options
+  TString value = "";
+  TObjArray* arr = options.Tokenize(" ");
+  for ( Int_t iopt=0; iopt<arr->GetEntriesFast(); ++iopt ) {
+    TString opt = arr->At(iopt)->GetName();
+    if ( opt.BeginsWith(key+"=") ) value = opt(key.Length()+1,opt.Length());
+  }
+  delete arr;
+  return value;
+}
+
+#endif